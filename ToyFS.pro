@@ -22,7 +22,7 @@ DEFINES += QT_DEPRECATED_WARNINGS
 # You can also select to disable deprecated APIs only up to a certain version of Qt.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
-CONFIG += c++11
+CONFIG += c++17
 
 SOURCES += \
         main.cc \
@@ -30,6 +30,12 @@ SOURCES += \
     gui/dirview.cc \
     disk.cc \
     filesystem.cc \
+    filebuf.cc \
+    compressor.cc \
+    crc32c.cc \
+    executor.cc \
+    iosched.cc \
+    trace.cc \
     gui/readandwritedialog.cc \
     gui/filepropertiesdialog.cc
 
@@ -37,6 +43,12 @@ HEADERS += \
     gui/mainwindow.h \
     gui/dirview.h \
     filesystem.h \
+    filebuf.h \
+    compressor.h \
+    crc32c.h \
+    executor.h \
+    iosched.h \
+    trace.h \
     disk.h \
     gui/readandwritedialog.h \
     gui/filepropertiesdialog.h
@@ -0,0 +1,3 @@
+#!/bin/bash
+g++ -std=c++17 -I.. -pthread -o toyfs toyfs.cc ../disk.cc ../filesystem.cc ../compressor.cc ../crc32c.cc ../executor.cc ../iosched.cc ../trace.cc
+g++ -std=c++17 -I.. -pthread -o toyfs-replay replay.cc ../disk.cc ../filesystem.cc ../compressor.cc ../crc32c.cc ../executor.cc ../iosched.cc ../trace.cc
@@ -0,0 +1,272 @@
+#include "disk.h"
+#include "filesystem.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// 用法：toyfs-replay [-d 磁盘映像] [-j 线程数] [-r] TRACE
+//
+// 在新建的磁盘映像上重新执行 FileSystem::startTrace 记录的调用，默认尽快执行，-r 按记录中的时间间隔执行。
+// 记录中的第 t 个线程的调用由第 t % j 个线程按时间顺序执行，j 默认为记录中的线程数。
+// 写入的数据是填充字节，描述符按记录中 open 的返回值对应到重放时的描述符。
+// 映像是空的，记录开始前已经存在的文件都不存在，对它们的调用计为失败；从空的文件系统开始记录可以完整重现。
+//
+// 结果以制表符分隔输出到标准输出，每种操作一行：次数、失败次数、重放的各百分位延迟和记录中的延迟（微秒），
+// 最后一行是全部操作的合计，以及总的吞吐量。
+
+namespace
+{
+
+const char* kUsage = "Usage: toyfs-replay [-d IMAGE] [-j THREADS] [-r] TRACE\n";
+
+struct Sample
+{
+    toyfs::TraceOp op;
+    double latency; // 微秒
+    bool succeeded;
+};
+
+class Replayer
+{
+public:
+    explicit Replayer(FileSystem& fs) : m_fs(fs), m_data(FileSystem::kMaxFileSize, 'x') {}
+
+    // 执行一条记录，buffer 用于读取
+    bool issue(const toyfs::TraceRecord& r, vector<char>& buffer)
+    {
+        int length = r.length < 0 ? 0 : r.length > FileSystem::kMaxFileSize ? FileSystem::kMaxFileSize : r.length;
+        char* out = buffer.data();
+        const char* in = m_data.data();
+        switch (r.op)
+        {
+        case toyfs::TraceOp::CreateDir: return m_fs.createDir(r.path);
+        case toyfs::TraceOp::CreateFile: return m_fs.createFile(r.path, r.flags);
+        case toyfs::TraceOp::OpenFile: return m_fs.openFile(r.path, r.flags);
+        case toyfs::TraceOp::CloseFile: return m_fs.closeFile(r.path);
+        case toyfs::TraceOp::Open:
+        {
+            int fd = m_fs.open(r.path, r.flags);
+            if (r.handle >= 0)
+            {
+                lock_guard<mutex> lock(m_mutex);
+                m_fds[r.handle] = fd;
+            }
+            return fd >= 0;
+        }
+        case toyfs::TraceOp::Close: return m_fs.close(fdOf(r.handle));
+        case toyfs::TraceOp::Read: return m_fs.read(fdOf(r.handle), out, length) >= 0;
+        case toyfs::TraceOp::Write: return m_fs.write(fdOf(r.handle), in, length);
+        case toyfs::TraceOp::ReadAt: return m_fs.readAt(fdOf(r.handle), r.offset, out, length) >= 0;
+        case toyfs::TraceOp::WriteAt: return m_fs.writeAt(fdOf(r.handle), r.offset, in, length);
+        case toyfs::TraceOp::Readv:
+        {
+            auto iov = split(out, length, r.flags);
+            return m_fs.readv(fdOf(r.handle), iov.data(), static_cast<int>(iov.size())) >= 0;
+        }
+        case toyfs::TraceOp::Writev:
+        {
+            auto iov = split(const_cast<char*>(in), length, r.flags); // 写操作只会读取数据段
+            return m_fs.writev(fdOf(r.handle), iov.data(), static_cast<int>(iov.size()));
+        }
+        case toyfs::TraceOp::ReadFile: return m_fs.readFile(r.path, out, length) >= 0;
+        case toyfs::TraceOp::WriteFile: return m_fs.writeFile(r.path, in, length);
+        case toyfs::TraceOp::SetFileAttributes: return m_fs.setFileAttributes(r.path, r.flags);
+        case toyfs::TraceOp::Stat:
+        {
+            FileSystem::Stat st;
+            return r.path.empty() ? m_fs.stat(fdOf(r.handle), st) : m_fs.stat(r.path, st);
+        }
+        case toyfs::TraceOp::Clone: return m_fs.clone(r.path, r.path2);
+        case toyfs::TraceOp::DeleteEntry: return m_fs.deleteEntry(r.path);
+        case toyfs::TraceOp::GetEntry: return m_fs.getEntry(r.path) != nullptr;
+        case toyfs::TraceOp::Exist:
+        {
+            m_fs.exist(r.path); // 不存在也是正常的结果
+            return true;
+        }
+        case toyfs::TraceOp::Sync: return m_fs.sync();
+        case toyfs::TraceOp::Checkpoint: return m_fs.checkpoint();
+        default: return false;
+        }
+    }
+
+private:
+    // 记录中的描述符对应的重放时的描述符
+    int fdOf(int handle)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        auto iter = m_fds.find(handle);
+        return iter == m_fds.end() ? -1 : iter->second;
+    }
+
+    // 把 length 个字节分成 count 个数据段
+    static vector<FileSystem::IoVec> split(char* base, int length, int count)
+    {
+        count = max(1, count);
+        vector<FileSystem::IoVec> iov;
+        for (int i = 0; i != count; ++i)
+        {
+            int begin = length * i / count;
+            iov.push_back({base + begin, length * (i + 1) / count - begin});
+        }
+        return iov;
+    }
+
+    FileSystem& m_fs;
+    const string m_data; // 写入的填充数据
+    unordered_map<int, int> m_fds;
+    mutex m_mutex;
+};
+
+double percentile(const vector<double>& sorted, double p)
+{
+    return sorted.empty() ? 0 : sorted[static_cast<size_t>(p * (sorted.size() - 1))];
+}
+
+void print(const string& name, vector<double>& latencies, vector<double>& traced, int failures)
+{
+    sort(latencies.begin(), latencies.end());
+    sort(traced.begin(), traced.end());
+    cout << name << '\t' << latencies.size() << '\t' << failures << '\t' << percentile(latencies, 0.5) << '\t'
+         << percentile(latencies, 0.9) << '\t' << percentile(latencies, 0.99) << '\t'
+         << (latencies.empty() ? 0 : latencies.back()) << '\t' << percentile(traced, 0.5) << '\t'
+         << percentile(traced, 0.99) << '\n';
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    string diskPath = "replay.disk";
+    string tracePath;
+    int numOfThreads = 0;
+    bool timed = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        string option = argv[i];
+        if (option == "-r") timed = true;
+        else if (option == "-d" && i + 1 < argc) diskPath = argv[++i];
+        else if (option == "-j" && i + 1 < argc) numOfThreads = max(1, atoi(argv[++i]));
+        else if (option[0] != '-' && tracePath.empty()) tracePath = option;
+        else
+        {
+            cerr << kUsage;
+            return 2;
+        }
+    }
+    if (tracePath.empty())
+    {
+        cerr << kUsage;
+        return 2;
+    }
+
+    // 读入所有记录
+    toyfs::TraceReader reader(tracePath);
+    if (!reader.isValid())
+    {
+        cerr << "Cannot read " << tracePath << "." << endl;
+        return 1;
+    }
+    vector<toyfs::TraceRecord> records;
+    toyfs::TraceRecord record;
+    int numOfTracedThreads = 0;
+    while (reader.next(record))
+    {
+        numOfTracedThreads = max(numOfTracedThreads, record.thread + 1);
+        records.push_back(record);
+    }
+    if (numOfThreads == 0) numOfThreads = max(1, numOfTracedThreads);
+
+    // 分给各线程，每个线程按时间顺序执行
+    vector<vector<const toyfs::TraceRecord*>> streams(numOfThreads);
+    for (const auto& r : records)
+    {
+        streams[r.thread % numOfThreads].push_back(&r);
+    }
+    for (auto& stream : streams)
+    {
+        stable_sort(stream.begin(), stream.end(), [](const toyfs::TraceRecord* a, const toyfs::TraceRecord* b) {
+            return a->timestamp < b->timestamp;
+        });
+    }
+
+    if (!Disk::CreateDisk(diskPath))
+    {
+        cerr << "Cannot create " << diskPath << "." << endl;
+        return 1;
+    }
+    vector<vector<Sample>> samples(numOfThreads);
+    double seconds;
+    {
+        Disk disk(diskPath);
+        FileSystem fs(disk);
+        if (!fs.initFileSystem()) return 1;
+        Replayer replayer(fs);
+
+        auto begin = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (int t = 0; t != numOfThreads; ++t)
+        {
+            threads.emplace_back([&, t]() {
+                vector<char> buffer(FileSystem::kMaxFileSize);
+                for (const auto* r : streams[t])
+                {
+                    if (timed) this_thread::sleep_until(begin + chrono::microseconds(r->timestamp));
+                    auto start = chrono::steady_clock::now();
+                    bool succeeded = replayer.issue(*r, buffer);
+                    double latency = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+                    samples[t].push_back({r->op, latency, succeeded});
+                }
+            });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    }
+    remove(diskPath.c_str());
+
+    // 按操作统计
+    const int kNumOfOps = static_cast<int>(toyfs::TraceOp::NumOfOps);
+    vector<vector<double>> latencies(kNumOfOps + 1), traced(kNumOfOps + 1); // 最后一项是合计
+    vector<int> failures(kNumOfOps + 1, 0);
+    for (const auto& s : samples)
+    {
+        for (const auto& sample : s)
+        {
+            for (int i : {static_cast<int>(sample.op), kNumOfOps})
+            {
+                latencies[i].push_back(sample.latency);
+                if (!sample.succeeded) ++failures[i];
+            }
+        }
+    }
+    for (const auto& r : records)
+    {
+        traced[static_cast<int>(r.op)].push_back(static_cast<double>(r.duration));
+        traced[kNumOfOps].push_back(static_cast<double>(r.duration));
+    }
+
+    cout << "# op\tcount\tfailures\tp50_us\tp90_us\tp99_us\tmax_us\ttrace_p50_us\ttrace_p99_us\n";
+    for (int i = 0; i != kNumOfOps; ++i)
+    {
+        if (latencies[i].empty()) continue;
+        print(toyfs::traceOpName(static_cast<toyfs::TraceOp>(i)), latencies[i], traced[i], failures[i]);
+    }
+    print("total", latencies[kNumOfOps], traced[kNumOfOps], failures[kNumOfOps]);
+    cout << "# " << records.size() << " operations on " << numOfThreads << " threads in " << seconds << " s, "
+         << static_cast<long>(seconds > 0 ? records.size() / seconds : 0) << " ops/sec\n";
+    return 0;
+}
@@ -0,0 +1,342 @@
+#include "disk.h"
+#include "filesystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+
+const char* kUsage = "Usage: toyfs [-t] [-T TRACE] IMAGE COMMAND [ARGS...]\n"
+                     "       toyfs [-t] [-T TRACE] IMAGE -f SCRIPT\n"
+                     "\n"
+                     "Commands:\n"
+                     "  mkfs [SOURCE]       create a file system, erasing the image, and load SOURCE\n"
+                     "                      into it: a host directory, a tar file, or - for tar on stdin\n"
+                     "  ls [PATH]           list a directory, / by default\n"
+                     "  cat PATH            write a file to stdout\n"
+                     "  put HOSTFILE PATH   copy a host file into a new file\n"
+                     "  get PATH HOSTFILE   copy a file out to the host\n"
+                     "  rm PATH             delete a file or an empty directory\n"
+                     "  mkdir PATH          create a directory\n"
+                     "  stat PATH           show the attributes and size of an entry\n"
+                     "  fsck [-r]           check consistency, and repair with -r\n"
+                     "\n"
+                     "-f runs one command per line of SCRIPT (- for stdin) against a single mount,\n"
+                     "skipping blank lines and lines starting with #, and stops at the first failure.\n"
+                     "-t reports the time taken by each command on stderr.\n"
+                     "-T records the file system calls to TRACE for toyfs-replay.\n";
+
+string attributesToString(FileSystem::Attributes attributes)
+{
+    string s;
+    s += attributes & FileSystem::Directory ? 'd' : '-';
+    s += attributes & FileSystem::ReadOnly ? 'r' : '-';
+    s += attributes & FileSystem::System ? 's' : '-';
+    s += attributes & FileSystem::Compressed ? 'c' : '-';
+    return s;
+}
+
+bool readHostFile(const string& path, string& data)
+{
+    ifstream is(path, ios::binary);
+    if (!is) return false;
+    data.assign(istreambuf_iterator<char>(is), istreambuf_iterator<char>());
+    return !is.bad();
+}
+
+// 去掉开头的 "./" 和 '/' 以及结尾的 '/'，转换为文件系统中的绝对路径
+string toFullPath(string path)
+{
+    while (path.compare(0, 2, "./") == 0 || path.compare(0, 1, "/") == 0)
+    {
+        path.erase(0, path[0] == '.' ? 2 : 1);
+    }
+    while (!path.empty() && path.back() == '/')
+    {
+        path.pop_back();
+    }
+    return "/" + path;
+}
+
+// 读取主机上的目录树，按路径排序
+bool readHostDir(const string& root, vector<FileSystem::BulkEntry>& entries)
+{
+    error_code ec;
+    for (filesystem::recursive_directory_iterator iter(root, ec), end; !ec && iter != end; iter.increment(ec))
+    {
+        string path = toFullPath(iter->path().lexically_relative(root).generic_string());
+        if (iter->is_directory())
+        {
+            entries.push_back({path, true, string()});
+        }
+        else if (iter->is_regular_file())
+        {
+            entries.push_back({path, false, string()});
+            if (!readHostFile(iter->path().string(), entries.back().data)) return false;
+        }
+    }
+    sort(entries.begin(), entries.end(),
+         [](const FileSystem::BulkEntry& a, const FileSystem::BulkEntry& b) { return a.fullPath < b.fullPath; });
+    return !ec;
+}
+
+// 读取 tar 流中的目录和普通文件，忽略链接等其他类型
+bool readTar(istream& is, vector<FileSystem::BulkEntry>& entries)
+{
+    const int kTarBlockSize = 512;
+    char header[kTarBlockSize];
+    while (is.read(header, kTarBlockSize))
+    {
+        if (header[0] == '\0') return true; // 结束标志
+        string name(header, strnlen(header, 100));
+        if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0') // 长路径的前缀
+        {
+            name = string(header + 345, strnlen(header + 345, 155)) + "/" + name;
+        }
+        long size = strtol(string(header + 124, 12).c_str(), nullptr, 8);
+        char type = header[156];
+        string data(size, '\0');
+        if (!is.read(&data[0], size)) return false;
+        is.ignore((kTarBlockSize - size % kTarBlockSize) % kTarBlockSize);
+
+        string path = toFullPath(name);
+        if (path == "/") continue;
+        if (type == '5') entries.push_back({path, true, string()});
+        else if (type == '0' || type == '\0') entries.push_back({path, false, move(data)});
+    }
+    return is.eof();
+}
+
+/**
+ * @brief runCommand 执行一条命令，结果写到标准输出，错误写到标准错误。
+ * @return true if succeeded.
+ */
+bool runCommand(FileSystem& fs, const vector<string>& args)
+{
+    const string& command = args[0];
+    size_t argc = args.size() - 1; // 参数个数
+
+    if (command == "mkfs" && argc == 0)
+    {
+        return fs.initFileSystem();
+    }
+    if (command == "mkfs" && argc == 1)
+    {
+        vector<FileSystem::BulkEntry> entries;
+        bool readable;
+        if (args[1] == "-")
+        {
+            readable = readTar(cin, entries);
+        }
+        else if (filesystem::is_directory(args[1]))
+        {
+            readable = readHostDir(args[1], entries);
+        }
+        else
+        {
+            ifstream is(args[1], ios::binary);
+            readable = is && readTar(is, entries);
+        }
+        if (!readable)
+        {
+            cerr << "Cannot read " << args[1] << "." << endl;
+            return false;
+        }
+        return fs.bulkLoad(entries);
+    }
+    if (command == "ls" && argc <= 1)
+    {
+        auto dir = fs.getEntry(argc == 1 ? args[1] : "/");
+        if (dir == nullptr || !dir->isDir()) return false;
+        for (const auto& child : dir->getChildren())
+        {
+            cout << attributesToString(child->attributes()) << ' ' << setw(6) << child->size() << ' ' << child->name()
+                 << '\n';
+        }
+        return true;
+    }
+    if (command == "cat" && argc == 1)
+    {
+        auto entry = fs.getEntry(args[1]);
+        if (entry == nullptr || entry->isDir()) return false;
+        auto data = fs.readFile(args[1], entry->size());
+        fs.closeFile(args[1]);
+        cout << *data;
+        return static_cast<int>(data->size()) == entry->size();
+    }
+    if (command == "put" && argc == 2)
+    {
+        string data;
+        if (!readHostFile(args[1], data) || static_cast<int>(data.size()) > FileSystem::kMaxFileSize) return false;
+        if (!fs.createFile(args[2], FileSystem::File)) return false;
+        bool succeeded = fs.writeFile(args[2], data.data(), static_cast<int>(data.size()));
+        return fs.closeFile(args[2]) && succeeded;
+    }
+    if (command == "get" && argc == 2)
+    {
+        auto entry = fs.getEntry(args[1]);
+        if (entry == nullptr || entry->isDir()) return false;
+        auto data = fs.readFile(args[1], entry->size());
+        fs.closeFile(args[1]);
+        ofstream os(args[2], ios::binary);
+        os << *data;
+        return os.good() && static_cast<int>(data->size()) == entry->size();
+    }
+    if (command == "rm" && argc == 1)
+    {
+        return fs.deleteEntry(args[1]);
+    }
+    if (command == "mkdir" && argc == 1)
+    {
+        return fs.createDir(args[1]);
+    }
+    if (command == "stat" && argc == 1)
+    {
+        auto entry = fs.getEntry(args[1]);
+        if (entry == nullptr) return false;
+        cout << "attributes: " << attributesToString(entry->attributes()) << '\n';
+        FileSystem::Stat st;
+        if (!entry->isDir() && fs.stat(args[1], st))
+        {
+            cout << "size: " << st.size << '\n';
+            cout << "blocks: " << st.numOfBlocks << '\n';
+            cout << "compression: " << st.compressionRatio << '\n';
+        }
+        return true;
+    }
+    if (command == "fsck" && (argc == 0 || (argc == 1 && args[1] == "-r")))
+    {
+        FileSystem::FsckReport report;
+        bool succeeded = fs.fsck(report, argc == 1);
+        cout << "directories: " << report.directories << '\n';
+        cout << "files: " << report.files << '\n';
+        cout << "bad entries: " << report.badEntries << '\n';
+        cout << "broken chains: " << report.brokenChains << '\n';
+        cout << "reference count errors: " << report.refCountErrors << '\n';
+        cout << "leaked blocks: " << report.leakedBlocks << '\n';
+        if (report.repaired) cout << "repaired\n";
+        return succeeded;
+    }
+
+    cerr << "Unknown command or wrong arguments: " << command << endl;
+    return false;
+}
+
+// 执行一条命令并按需报告耗时
+bool runTimedCommand(FileSystem& fs, const vector<string>& args, bool timing)
+{
+    auto start = chrono::steady_clock::now();
+    bool succeeded = runCommand(fs, args);
+    if (timing)
+    {
+        auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        cerr << args[0] << '\t' << us << " us" << endl;
+    }
+    return succeeded;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    vector<string> args(argv + 1, argv + argc);
+    bool timing = false;
+    string tracePath;
+    while (!args.empty() && (args[0] == "-t" || (args[0] == "-T" && args.size() > 1)))
+    {
+        if (args[0] == "-t")
+        {
+            timing = true;
+            args.erase(args.begin());
+        }
+        else
+        {
+            tracePath = args[1];
+            args.erase(args.begin(), args.begin() + 2);
+        }
+    }
+    if (args.size() < 2)
+    {
+        cerr << kUsage;
+        return 2;
+    }
+    string image = args[0];
+    args.erase(args.begin());
+
+    // 单独的 mkfs 总是重新创建映像
+    if (args[0] == "mkfs" && args.size() <= 2 && !Disk::CreateDisk(image))
+    {
+        cerr << "Cannot create " << image << "." << endl;
+        return 1;
+    }
+    Disk disk(image);
+    if (!disk.isValid())
+    {
+        cerr << "Cannot open " << image << "." << endl;
+        return 1;
+    }
+    FileSystem fs(disk);
+    if (!tracePath.empty() && !fs.startTrace(tracePath))
+    {
+        cerr << "Cannot create " << tracePath << "." << endl;
+        return 1;
+    }
+
+    if (args[0] != "-f") // 单条命令
+    {
+        if (runTimedCommand(fs, args, timing)) return 0;
+        cerr << "toyfs: " << args[0] << " failed." << endl;
+        return 1;
+    }
+
+    // 批处理
+    if (args.size() != 2)
+    {
+        cerr << kUsage;
+        return 2;
+    }
+    ifstream file;
+    if (args[1] != "-") file.open(args[1]);
+    istream& script = args[1] == "-" ? cin : file;
+    if (!script)
+    {
+        cerr << "Cannot open " << args[1] << "." << endl;
+        return 1;
+    }
+    auto start = chrono::steady_clock::now();
+    string line;
+    int lineNumber = 0;
+    int numOfCommands = 0;
+    while (getline(script, line))
+    {
+        ++lineNumber;
+        istringstream words(line);
+        vector<string> command((istream_iterator<string>(words)), istream_iterator<string>());
+        if (command.empty() || command[0][0] == '#') continue;
+        if (!runTimedCommand(fs, command, timing))
+        {
+            cerr << "toyfs: line " << lineNumber << ": " << command[0] << " failed." << endl;
+            return 1;
+        }
+        ++numOfCommands;
+    }
+    if (timing)
+    {
+        auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        cerr << "total\t" << us << " us, " << numOfCommands << " commands" << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include "compressor.h"
+
+#include <algorithm>
+
+namespace toyfs
+{
+namespace lz
+{
+
+namespace
+{
+
+const int kHashBits = 8;
+const int kHashSize = 1 << kHashBits;
+
+int hash(const unsigned char* p)
+{
+    unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return static_cast<int>((v * 2654435761u) >> (32 - kHashBits));
+}
+
+} // namespace
+
+int compress(const char* src, int n, char* dst, int capacity)
+{
+    auto in = reinterpret_cast<const unsigned char*>(src);
+    int head[kHashSize]; // 每个哈希值最近一次出现的位置
+    std::fill(head, head + kHashSize, -1);
+
+    int ip = 0; // 输入位置
+    int op = 0; // 输出位置
+    int literalStart = 0;
+
+    // 输出 [literalStart, end) 范围内的字面量
+    auto flushLiterals = [&](int end) {
+        while (literalStart < end)
+        {
+            int run = std::min(end - literalStart, kMaxLiteralRun);
+            if (op + 1 + run > capacity) return false;
+            dst[op++] = static_cast<char>(run - 1);
+            std::copy(src + literalStart, src + literalStart + run, dst + op);
+            op += run;
+            literalStart += run;
+        }
+        return true;
+    };
+
+    while (ip + kMinMatch <= n)
+    {
+        int h = hash(in + ip);
+        int candidate = head[h];
+        head[h] = ip;
+        if (candidate < 0 || ip - candidate > kMaxDistance || !std::equal(in + ip, in + ip + kMinMatch, in + candidate))
+        {
+            ++ip;
+            continue;
+        }
+
+        // 贪心地延长匹配，匹配可以与当前位置重叠
+        int length = kMinMatch;
+        while (ip + length < n && length < kMaxMatch && in[candidate + length] == in[ip + length])
+        {
+            ++length;
+        }
+
+        if (!flushLiterals(ip)) return -1;
+        if (op + 2 > capacity) return -1;
+        dst[op++] = static_cast<char>(0x80 | (length - kMinMatch));
+        dst[op++] = static_cast<char>(ip - candidate - 1);
+
+        for (int k = ip + 1; k < ip + length && k + kMinMatch <= n; ++k)
+        {
+            head[hash(in + k)] = k;
+        }
+        ip += length;
+        literalStart = ip;
+    }
+    if (!flushLiterals(n)) return -1;
+
+    return op;
+}
+
+int decompress(const char* src, int n, char* dst, int capacity)
+{
+    auto in = reinterpret_cast<const unsigned char*>(src);
+    int ip = 0;
+    int op = 0;
+
+    while (ip < n)
+    {
+        int token = in[ip++];
+        if (token < 0x80) // 字面量
+        {
+            int run = token + 1;
+            if (ip + run > n || op + run > capacity) return -1;
+            std::copy(src + ip, src + ip + run, dst + op);
+            ip += run;
+            op += run;
+        }
+        else // 匹配，逐字节复制以支持重叠
+        {
+            if (ip >= n) return -1;
+            int length = (token & 0x7f) + kMinMatch;
+            int distance = in[ip++] + 1;
+            if (distance > op || op + length > capacity) return -1;
+            for (int k = 0; k != length; ++k, ++op)
+            {
+                dst[op] = dst[op - distance];
+            }
+        }
+    }
+
+    return op;
+}
+
+} // namespace lz
+} // namespace toyfs
@@ -0,0 +1,47 @@
+//===-- compressor.h - LZ codec for compressed files ----------------------===//
+//
+// The Toy FAT FileSystem
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// A small byte-oriented LZ77 codec used by FileSystem to store files with the
+/// Compressed attribute. It has no dependency and works on a whole compression
+/// unit at a time.
+///
+/// Stream format, a sequence of tokens:
+///   0xxxxxxx            literal run of x + 1 bytes, followed by the bytes
+///   1xxxxxxx dddddddd   match of x + kMinMatch bytes, d + 1 bytes back
+///
+//===----------------------------------------------------------------------===//
+#ifndef TOYFS_COMPRESSOR_H_
+#define TOYFS_COMPRESSOR_H_
+
+namespace toyfs
+{
+namespace lz
+{
+
+static const int kMinMatch = 3;
+static const int kMaxMatch = 0x7f + kMinMatch;
+static const int kMaxLiteralRun = 0x80;
+static const int kMaxDistance = 0x100;
+
+/**
+ * @brief compress 压缩 src 中的 n 个字节。
+ * @param capacity dst 的大小。
+ * @return 压缩后的字节数，超出 capacity 时为 -1。
+ */
+int compress(const char* src, int n, char* dst, int capacity);
+
+/**
+ * @brief decompress 解压 src 中的 n 个字节。
+ * @param capacity dst 的大小。
+ * @return 解压后的字节数，数据损坏或超出 capacity 时为 -1。
+ */
+int decompress(const char* src, int n, char* dst, int capacity);
+
+} // namespace lz
+} // namespace toyfs
+
+#endif // TOYFS_COMPRESSOR_H_
@@ -0,0 +1,84 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define TOYFS_HAVE_SSE42_CRC 1
+#include <nmmintrin.h>
+#endif
+
+namespace toyfs
+{
+
+namespace
+{
+
+const std::uint32_t kPolynomial = 0x82f63b78; // CRC32C 的反射多项式
+
+// 逐字节查表的实现，任何平台都可用
+struct Table
+{
+    std::uint32_t entries[256];
+
+    Table()
+    {
+        for (std::uint32_t i = 0; i != 256; ++i)
+        {
+            std::uint32_t crc = i;
+            for (int k = 0; k != 8; ++k)
+            {
+                crc = (crc >> 1) ^ (kPolynomial & (0u - (crc & 1)));
+            }
+            entries[i] = crc;
+        }
+    }
+};
+
+std::uint32_t crc32cPortable(std::uint32_t crc, const unsigned char* p, int n)
+{
+    static const Table table;
+    for (int i = 0; i != n; ++i)
+    {
+        crc = table.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef TOYFS_HAVE_SSE42_CRC
+// 每条指令处理 8 个字节，一个 64 字节的块只需要 8 条
+__attribute__((target("sse4.2"))) std::uint32_t crc32cHardware(std::uint32_t crc, const unsigned char* p, int n)
+{
+    std::uint64_t crc64 = crc;
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<std::uint32_t>(crc64);
+    for (; n > 0; ++p, --n)
+    {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+
+bool hasHardwareCrc()
+{
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+}
+#endif
+
+} // namespace
+
+std::uint32_t crc32c(const char* data, int n)
+{
+    auto p = reinterpret_cast<const unsigned char*>(data);
+#ifdef TOYFS_HAVE_SSE42_CRC
+    if (hasHardwareCrc()) return ~crc32cHardware(~0u, p, n);
+#endif
+    return ~crc32cPortable(~0u, p, n);
+}
+
+} // namespace toyfs
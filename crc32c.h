@@ -0,0 +1,27 @@
+//===-- crc32c.h - CRC32C checksum ----------------------------------------===//
+//
+// The Toy FAT FileSystem
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// CRC32C (Castagnoli) used by FileSystem to checksum blocks. Uses the SSE4.2
+/// crc32 instruction when the CPU has it and a table-driven fallback otherwise.
+///
+//===----------------------------------------------------------------------===//
+#ifndef TOYFS_CRC32C_H_
+#define TOYFS_CRC32C_H_
+
+#include <cstdint>
+
+namespace toyfs
+{
+
+/**
+ * @brief crc32c 计算 data 中 n 个字节的 CRC32C。
+ */
+std::uint32_t crc32c(const char* data, int n);
+
+} // namespace toyfs
+
+#endif // TOYFS_CRC32C_H_
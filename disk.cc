@@ -50,28 +50,40 @@ bool Disk::isValid()
 }
 
 bool Disk::read(char* buf, int sector)
+{
+    return read(buf, sector, 1);
+}
+
+bool Disk::write(const char* buf, int sector)
+{
+    return write(buf, sector, 1);
+}
+
+bool Disk::read(char* buf, int sector, int count)
 {
     std::lock_guard<std::mutex> lock(m_mutex);
 
     m_ioFile.seekg(kSectorSize * sector, std::ios::beg);
-    m_ioFile.read(buf, kSectorSize);
+    m_ioFile.read(buf, kSectorSize * count);
 
-    return m_ioFile.gcount() == kSectorSize;
+    return m_ioFile.gcount() == kSectorSize * count;
 }
 
-bool Disk::write(char* buf, int sector)
+bool Disk::write(const char* buf, int sector, int count)
 {
     std::lock_guard<std::mutex> lock(m_mutex);
 
     m_ioFile.seekp(kSectorSize * sector, std::ios::beg);
     auto posBefore = m_ioFile.tellp();
-    m_ioFile.write(buf, kSectorSize);
+    m_ioFile.write(buf, kSectorSize * count);
     auto posAfter = m_ioFile.tellp();
 
-    return posAfter - posBefore == kSectorSize;
+    return posAfter - posBefore == kSectorSize * count;
 }
 
 bool Disk::sync()
 {
+    std::lock_guard<std::mutex> lock(m_mutex); // 与读写共用同一个文件流
+
     return m_ioFile.sync() == 0; // NOTE: 这个地方似乎不支持用 clang 编译，clang-7.0.0 on Archlinux x64
 }
@@ -52,7 +52,25 @@ public:
      * @param length Number of bytes to write.
      * @return true if succeeded.
      */
-    bool write(char* buf, int sector);
+    bool write(const char* buf, int sector);
+    /**
+     * @brief read Read count consecutive sectors with a single seek.
+     *
+     * @param buf Buffer to store data, at least count * kSectorSize bytes.
+     * @param sector Start sector.
+     * @param count Number of sectors to read.
+     * @return true if succeeded.
+     */
+    bool read(char* buf, int sector, int count);
+    /**
+     * @brief write Write count consecutive sectors with a single seek.
+     *
+     * @param buf Buffer to read data, at least count * kSectorSize bytes.
+     * @param sector Start sector.
+     * @param count Number of sectors to write.
+     * @return true if succeeded.
+     */
+    bool write(const char* buf, int sector, int count);
 
     bool sync();
 
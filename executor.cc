@@ -0,0 +1,53 @@
+#include "executor.h"
+
+namespace toyfs
+{
+
+Executor::Executor(int numOfThreads) : kNumOfThreads(numOfThreads), m_stopping(false) {}
+
+Executor::~Executor()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cond.notify_all();
+    for (auto& t : m_threads)
+    {
+        t.join();
+    }
+}
+
+void Executor::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+        if (m_threads.empty()) // 第一次提交时才启动工作线程
+        {
+            for (int i = 0; i != kNumOfThreads; ++i)
+            {
+                m_threads.emplace_back(&Executor::run, this);
+            }
+        }
+    }
+    m_cond.notify_one();
+}
+
+void Executor::run()
+{
+    for (;;)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+            if (m_tasks.empty()) return; // 正在停止并且没有剩余的任务
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
+
+} // namespace toyfs
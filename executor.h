@@ -0,0 +1,57 @@
+//===-- executor.h - Fixed-size thread pool -------------------------------===//
+//
+// The Toy FAT FileSystem
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// A small FIFO thread pool that runs the asynchronous FileSystem calls. The
+/// worker threads are started on the first submit, so a FileSystem that never
+/// uses the async API costs no threads.
+///
+//===----------------------------------------------------------------------===//
+#ifndef TOYFS_EXECUTOR_H_
+#define TOYFS_EXECUTOR_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace toyfs
+{
+
+class Executor
+{
+public:
+    explicit Executor(int numOfThreads);
+    /**
+     * @brief ~Executor 执行完队列中剩余的任务后结束所有工作线程。
+     */
+    ~Executor();
+    // keep from copying
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    /**
+     * @brief submit 把任务加入队列，由某个工作线程按提交顺序取出执行。
+     */
+    void submit(std::function<void()> task);
+
+private:
+    void run(); // 工作线程的主循环
+
+    const int kNumOfThreads;
+
+    std::vector<std::thread> m_threads;
+    std::deque<std::function<void()>> m_tasks;
+    bool m_stopping;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+};
+
+} // namespace toyfs
+
+#endif // TOYFS_EXECUTOR_H_
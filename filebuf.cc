@@ -0,0 +1,249 @@
+#include "filebuf.h"
+
+#include "filesystem.h"
+
+#include <algorithm>
+
+namespace toyfs
+{
+
+filebuf::filebuf() :
+    m_fs(nullptr), m_fd(-1), m_mode(), m_buffer(nullptr), m_bufferSize(0), m_bufferOffset(0)
+{
+}
+
+filebuf::~filebuf()
+{
+    close();
+}
+
+filebuf* filebuf::open(FileSystem& fs, const std::string& fullPath, std::ios_base::openmode mode, int bufferBlocks)
+{
+    if (is_open()) return nullptr;                   // 已经打开了一个文件
+    if (mode & std::ios_base::trunc) return nullptr; // 不支持截断
+
+    FileSystem::OpenModes openModes = 0;
+    if (mode & std::ios_base::in) openModes |= FileSystem::Read;
+    if (mode & (std::ios_base::out | std::ios_base::app)) openModes |= FileSystem::Write;
+    if (openModes == 0) return nullptr;
+
+    int fd = fs.open(fullPath, openModes);
+    if (fd < 0) return nullptr;
+
+    m_fs = &fs;
+    m_fd = fd;
+    m_mode = mode;
+
+    // 没有通过 setbuf 指定外部缓冲区时使用自己的缓冲区
+    if (m_buffer == nullptr || m_buffer == m_ownBuffer.data())
+    {
+        m_bufferSize = std::max(bufferBlocks, 1) * FileSystem::kBlockSize;
+        m_ownBuffer.resize(m_bufferSize);
+        m_buffer = m_ownBuffer.data();
+    }
+
+    int start = 0;
+    if (mode & (std::ios_base::ate | std::ios_base::app))
+    {
+        FileSystem::Stat st;
+        if (m_fs->stat(m_fd, st)) start = st.size;
+    }
+    resetBuffer(start);
+
+    return this;
+}
+
+filebuf* filebuf::close()
+{
+    if (!is_open()) return nullptr;
+
+    bool success = flushBuffer();
+    success = m_fs->close(m_fd) && success;
+
+    m_fs = nullptr;
+    m_fd = -1;
+    resetBuffer(0);
+
+    return success ? this : nullptr;
+}
+
+filebuf::int_type filebuf::underflow()
+{
+    if (!is_open() || !(m_mode & std::ios_base::in)) return traits_type::eof();
+    if (gptr() != nullptr && gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+    if (!flushBuffer()) return traits_type::eof();
+    int pos = m_bufferOffset;
+
+    // 从块边界开始读，保证每次读取的都是整块
+    int start = pos - pos % FileSystem::kBlockSize;
+    int n = m_fs->readAt(m_fd, start, m_buffer, m_bufferSize);
+    if (n <= pos - start) return traits_type::eof(); // 已读到文件尾
+
+    m_bufferOffset = start;
+    setg(m_buffer, m_buffer + (pos - start), m_buffer + n);
+
+    return traits_type::to_int_type(*gptr());
+}
+
+filebuf::int_type filebuf::overflow(int_type ch)
+{
+    if (!is_open() || !(m_mode & (std::ios_base::out | std::ios_base::app))) return traits_type::eof();
+
+    if (!flushBuffer()) return traits_type::eof();
+    int pos = m_bufferOffset;
+
+    // 第一段写缓冲区截止到块边界，之后每次写回的都是整块
+    setp(m_buffer, m_buffer + m_bufferSize - pos % FileSystem::kBlockSize);
+
+    if (!traits_type::eq_int_type(ch, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+
+    return traits_type::not_eof(ch);
+}
+
+int filebuf::sync()
+{
+    return flushBuffer() ? 0 : -1;
+}
+
+std::streamsize filebuf::xsgetn(char_type* s, std::streamsize n)
+{
+    std::streamsize done = 0;
+
+    // 先取读缓冲区中已有的数据
+    if (gptr() != nullptr)
+    {
+        int m = static_cast<int>(std::min<std::streamsize>(n, egptr() - gptr()));
+        std::copy(gptr(), gptr() + m, s);
+        gbump(m);
+        done += m;
+    }
+
+    // 剩下的数据不少于一个缓冲区时直接读入调用者的缓冲区
+    if (n - done >= m_bufferSize && is_open() && (m_mode & std::ios_base::in))
+    {
+        if (!flushBuffer()) return done;
+        int pos = m_bufferOffset;
+        int m = m_fs->readAt(m_fd, pos, s + done, static_cast<int>(n - done));
+        resetBuffer(pos + m);
+        return done + m;
+    }
+
+    return done + std::streambuf::xsgetn(s + done, n - done);
+}
+
+std::streamsize filebuf::xsputn(const char_type* s, std::streamsize n)
+{
+    // 数据不少于一个缓冲区时直接从调用者的缓冲区写入
+    if (n >= m_bufferSize && is_open() && (m_mode & (std::ios_base::out | std::ios_base::app)))
+    {
+        if (!flushBuffer()) return 0;
+        int offset = writeOffset();
+        if (!m_fs->writeAt(m_fd, offset, s, static_cast<int>(n))) return 0;
+        resetBuffer(offset + static_cast<int>(n));
+        return n;
+    }
+
+    return std::streambuf::xsputn(s, n);
+}
+
+filebuf::pos_type filebuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+    (void)which; // 读写共用一个位置
+    if (!is_open()) return pos_type(off_type(-1));
+    if (dir == std::ios_base::cur && off == 0) return pos_type(position()); // 只是查询当前位置
+
+    if (!flushBuffer()) return pos_type(off_type(-1));
+
+    off_type base = 0;
+    if (dir == std::ios_base::cur)
+    {
+        base = m_bufferOffset;
+    }
+    else if (dir == std::ios_base::end)
+    {
+        FileSystem::Stat st;
+        if (!m_fs->stat(m_fd, st)) return pos_type(off_type(-1));
+        base = st.size;
+    }
+
+    off_type target = base + off;
+    if (target < 0 || target > FileSystem::kMaxFileSize) return pos_type(off_type(-1));
+    resetBuffer(static_cast<int>(target));
+
+    return pos_type(target);
+}
+
+filebuf::pos_type filebuf::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+std::streambuf* filebuf::setbuf(char_type* s, std::streamsize n)
+{
+    if (!flushBuffer()) return nullptr;
+
+    int size = static_cast<int>(std::max<std::streamsize>(n, FileSystem::kBlockSize));
+    size -= size % FileSystem::kBlockSize;
+    if (s != nullptr && n >= FileSystem::kBlockSize)
+    {
+        m_ownBuffer.clear();
+        m_buffer = s;
+    }
+    else
+    {
+        m_ownBuffer.resize(size);
+        m_buffer = m_ownBuffer.data();
+    }
+    m_bufferSize = size;
+
+    return this;
+}
+
+int filebuf::position()
+{
+    if (pbase() != nullptr) return m_bufferOffset + static_cast<int>(pptr() - pbase());
+    if (eback() != nullptr) return m_bufferOffset + static_cast<int>(gptr() - eback());
+    return m_bufferOffset;
+}
+
+int filebuf::writeOffset()
+{
+    if (m_mode & std::ios_base::app) // 追加方式总是写到文件尾
+    {
+        FileSystem::Stat st;
+        if (m_fs->stat(m_fd, st)) return st.size;
+    }
+    return m_bufferOffset;
+}
+
+bool filebuf::flushBuffer()
+{
+    int pos = position();
+    bool success = true;
+
+    if (pbase() != nullptr && pptr() > pbase())
+    {
+        int n = static_cast<int>(pptr() - pbase());
+        setp(nullptr, nullptr); // 先清空写缓冲区，writeOffset 依赖 m_bufferOffset
+        int offset = writeOffset();
+        success = m_fs->writeAt(m_fd, offset, m_buffer, n);
+        pos = offset + n;
+    }
+    resetBuffer(pos);
+
+    return success;
+}
+
+void filebuf::resetBuffer(int pos)
+{
+    setg(nullptr, nullptr, nullptr);
+    setp(nullptr, nullptr);
+    m_bufferOffset = pos;
+}
+
+} // namespace toyfs
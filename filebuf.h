@@ -0,0 +1,89 @@
+//===-- filebuf.h - toyfs::filebuf class definition -----------------------===//
+//
+// The Toy FAT FileSystem
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// std::streambuf adapter over FileSystem files, so that standard stream code
+/// can read and write ToyFS files.
+///
+//===----------------------------------------------------------------------===//
+#ifndef TOYFS_FILEBUF_H_
+#define TOYFS_FILEBUF_H_
+
+#include "filesystem.h"
+
+#include <ios>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace toyfs
+{
+
+class filebuf : public std::streambuf
+{
+public:
+    static const int kDefaultBufferBlocks = 8; // 默认缓冲区大小（块数）
+
+    filebuf();
+    ~filebuf() override;
+    // keep from copying
+    filebuf(const filebuf&) = delete;
+    filebuf& operator=(const filebuf&) = delete;
+
+    /**
+     * @brief open 打开文件。
+     *
+     * 支持 in、out、app 和 ate，不支持 trunc。
+     *
+     * @param fs 文件所在的文件系统。
+     * @param fullPath 文件绝对路径。
+     * @param mode 打开方式。
+     * @param bufferBlocks 缓冲区大小（块数），缓冲区总是按块对齐。
+     * @return 成功时为 this，否则为 nullptr。
+     */
+    filebuf* open(FileSystem& fs, const std::string& fullPath, std::ios_base::openmode mode,
+                  int bufferBlocks = kDefaultBufferBlocks);
+    bool is_open() const { return m_fs != nullptr; }
+    /**
+     * @brief close 写回缓冲区中的数据并关闭文件。
+     * @return 成功时为 this，否则为 nullptr。
+     */
+    filebuf* close();
+
+protected:
+    int_type underflow() override;
+    int_type overflow(int_type ch) override;
+    int sync() override;
+    std::streamsize xsgetn(char_type* s, std::streamsize n) override;
+    std::streamsize xsputn(const char_type* s, std::streamsize n) override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+    /**
+     * @brief setbuf 调整缓冲区大小，n 向下取整到块大小的整数倍，至少一块。
+     *
+     * s 不为空时直接使用调用者提供的缓冲区。
+     */
+    std::streambuf* setbuf(char_type* s, std::streamsize n) override;
+
+private:
+    FileSystem* m_fs;
+    int m_fd;
+    std::ios_base::openmode m_mode;
+
+    std::vector<char> m_ownBuffer;
+    char* m_buffer;     // 当前使用的缓冲区，同一时刻只作为读缓冲区或写缓冲区之一
+    int m_bufferSize;   // 缓冲区大小，块大小的整数倍
+    int m_bufferOffset; // 缓冲区起始位置对应的文件偏移
+
+    int position();            // 当前的文件偏移
+    int writeOffset();         // 写回写缓冲区时的文件偏移
+    bool flushBuffer();        // 写回写缓冲区并清空缓冲区，当前位置不变
+    void resetBuffer(int pos); // 清空缓冲区并把当前位置移到 pos
+};
+
+} // namespace toyfs
+
+#endif // TOYFS_FILEBUF_H_
@@ -1,88 +1,310 @@
 #include "filesystem.h"
 
+#include "compressor.h"
+#include "crc32c.h"
 #include "disk.h"
 
 #include <algorithm>
 #include <cassert>
+#include <functional>
 #include <iostream>
 #include <iterator>
 #include <list>
 #include <mutex>
 #include <sstream>
 
+namespace
+{
+
+// 当前线程持有事务锁（读锁或写锁）的文件系统
+thread_local std::vector<const FileSystem*> t_updating;
+
+// 当前线程中嵌套的 TraceScope 层数，只记录最外层的调用
+thread_local int t_traceDepth = 0;
+
+} // namespace
+
 FileSystem::FileSystem(Disk& disk) :
     kFatSize(Disk::kNumOfSector * Disk::kSectorSize / kBlockSize),
     kNumOfFatBlocks(Disk::kNumOfSector * Disk::kSectorSize / kBlockSize / kBlockSize),
-    kRootBlockNumber(Disk::kNumOfSector * Disk::kSectorSize / kBlockSize / kBlockSize), m_disk(disk)
+    kIndexBlockNumber(kNumOfFatBlocks), kRefCountBlockNumber(kIndexBlockNumber + kNumOfFatBlocks),
+    kChecksumBlockNumber(kRefCountBlockNumber + kNumOfFatBlocks), kNumOfChecksumBlocks(kFatSize / kChecksumsPerBlock),
+    kRootBlockNumber(kChecksumBlockNumber + kNumOfChecksumBlocks), kJournalBlockNumber(kFatSize - kNumOfJournalBlocks),
+    m_disk(disk), m_scheduler(disk), m_snapshotPins(kFatSize, 0), m_cacheStats({0, 0}), m_commitStats({0, 0}),
+    m_committing(false), m_verifyChecksums(true), m_checksumsVerified(0), m_checksumFailures(0),
+    m_committedTables(new char[kFatSize * 3]), m_tablesCommitted(false), m_journalHead(kJournalBlockNumber + 1),
+    m_journalSeq(1), m_journalInFlight(0), m_checkpointScheduled(false), m_journalPinned(kFatSize, false),
+    m_journalStats({0, 0, 0, 0}), m_executor(new toyfs::Executor(kNumOfAsyncWorkers)),
+    m_transactionOwner(std::thread::id()), m_transactionFreed(kFatSize, false),
+    m_tracing(false)
 {
     assert(kFatSize / kBlockSize == kNumOfFatBlocks);
-    assert(kRootBlockNumber == kNumOfFatBlocks);
+    assert(kFatSize <= kMaxBlocksPerFile);
 
     // FAT
     m_fat = new char[kFatSize];
     std::for_each(m_fat, m_fat + kFatSize, [](char& e) { e = 0; });
-
-    // buffer
-    m_buffer = new char[Disk::kSectorSize];
+    m_blockIndex = new char[kFatSize];
+    std::for_each(m_blockIndex, m_blockIndex + kFatSize, [](char& e) { e = 0; });
+    m_refCount = new char[kFatSize];
+    std::for_each(m_refCount, m_refCount + kFatSize, [](char& e) { e = 0; });
+    m_checksums.reset(new std::atomic<std::uint32_t>[kFatSize]);
+    std::for_each(m_checksums.get(), m_checksums.get() + kFatSize, [](std::atomic<std::uint32_t>& e) { e = 0; });
+    m_checksumDirty.reset(new std::atomic<bool>[kNumOfChecksumBlocks]);
+    std::for_each(m_checksumDirty.get(), m_checksumDirty.get() + kNumOfChecksumBlocks,
+                  [](std::atomic<bool>& e) { e = false; });
+
+    // 目录锁，以目录的块号为下标
+    m_dirLocks.reset(new std::shared_mutex[kFatSize]);
 
     // load FAT
-    bool succeeded = loadFat();
+    bool succeeded = loadFat() && reclaimOrphanedChains();
     if (!succeeded)
     {
         std::cerr << "Fatal: cannot load FAT from disk." << std::endl;
     }
 
     // root entry
-    m_rootEntry = std::make_shared<Entry>(m_disk);
+    m_rootEntry = std::make_shared<Entry>(*this);
     m_rootEntry->m_name = "/";
     m_rootEntry->m_attributes = FileSystem::Directory | FileSystem::System;
     m_rootEntry->m_blockStart = kRootBlockNumber;
-    m_rootEntry->m_numBlock = 0;
+    m_rootEntry->m_size = 0;
+    m_rootEntry->m_entryIndex = -1;
     m_rootEntry->m_parent = m_rootEntry->self();
 }
 
 FileSystem::~FileSystem()
 {
+    m_executor.reset(); // 先执行完还没有完成的异步调用
+    flushChecksums(); // 写回还没有保存的校验和
     delete[] m_fat;
-    delete[] m_buffer;
+    delete[] m_blockIndex;
+    delete[] m_refCount;
+    delete[] m_committedTables;
 }
 
 bool FileSystem::initFileSystem()
 {
+    TraceScope internalCall; // 不记录，其中的 sync 等调用也不记录
     bool success;
     // init fat
     for (int i = 0; i != kFatSize; ++i)
     {
         m_fat[i] = 0;
+        m_blockIndex[i] = 0;
+        m_refCount[i] = 0;
     }
-    for (int i = 0; i != kNumOfFatBlocks; ++i)
+    for (int i = 0; i != kFatSize; ++i)
     {
-        m_fat[i] = -1;
+        m_checksums[i] = 0; // 0 表示没有记录校验和
+    }
+    for (int i = 0; i != kNumOfChecksumBlocks; ++i)
+    {
+        m_checksumDirty[i] = true;
+    }
+    for (int i = 0; i != kRootBlockNumber; ++i)
+    {
+        m_fat[i] = -1; // FAT、逻辑块号表、引用计数表和校验和表占用的块
     }
     m_fat[23] = m_fat[49] = -2;   // 表示有两个坏块
     m_fat[kRootBlockNumber] = -1; // 根目录块已占用
-    // 保存 FAT
-    success = saveFat();
-    if (!success) return false;
+    m_refCount[kRootBlockNumber] = 1;
+    for (int i = kJournalBlockNumber; i != kFatSize; ++i)
+    {
+        m_fat[i] = -1; // 日志占用的块
+    }
 
-    std::lock_guard<std::mutex> bufferLock(m_mutex2Buffer);
+    // 清空日志，序号接着旧日志的序号，旧的记录不会被当作有效记录重放
+    {
+        std::lock_guard<std::mutex> journalLock(m_mutex2Journal);
+        m_journalHead = kJournalBlockNumber + 1;
+        std::fill(m_journalPinned.begin(), m_journalPinned.end(), false);
+        success = writeJournalSuperblock();
+        if (!success) return false;
+    }
+    m_tablesCommitted = false; // 所有的表都要提交
 
     // init root directory
-    for (int i = 0; i != kMaxChildEntries; ++i)
     {
-        m_buffer[kEntrySize * i] = '$'; // 所有的目录项都为空
+        std::lock_guard<std::shared_mutex> dirLock(m_dirLocks[kRootBlockNumber]);
+        std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
+        char buffer[kBlockSize];
+        for (int i = 0; i != kMaxChildEntries; ++i)
+        {
+            buffer[kEntrySize * i] = '$'; // 所有的目录项都为空
+        }
+        // 根目录和 FAT 作为一条日志记录提交
+        success = commitMetadata({{kRootBlockNumber, buffer}}, true);
+        if (!success) return false;
     }
-    // 写入根目录
-    success = m_disk.write(m_buffer, kRootBlockNumber);
-    if (!success) return false;
 
-    if (!sync()) return false; // 更改持久化
+    // 清除打开列表
+    for (auto& shard : m_fdShards)
+    {
+        std::lock_guard<std::mutex> shardLock(shard.mutex);
+        shard.paths.clear();
+        shard.slots.clear();
+        shard.freeSlots.clear();
+    }
 
-    m_openedFiles.clear(); // 清除打开列表
+    // 清除解压缓存
+    {
+        std::lock_guard<std::mutex> cacheLock(m_mutex3Cache);
+        m_unitCache.clear();
+        m_unitCacheIndex.clear();
+    }
 
     return true;
 }
 
+bool FileSystem::bulkLoad(const std::vector<BulkEntry>& entries)
+{
+    TraceScope internalCall; // 不记录
+    // 先在内存中建立目录树并检查
+    struct Node
+    {
+        std::string name;
+        bool isDir;
+        const std::string* data;
+        std::vector<int> children;
+    };
+    std::vector<Node> nodes = {{"/", true, nullptr, {}}};
+    for (const auto& e : entries)
+    {
+        if (e.fullPath.empty() || e.fullPath[0] != '/') return false; // 不是绝对路径
+        if (!e.isDir && static_cast<int>(e.data.size()) > kMaxFileSize) return false;
+        auto names = splitPath(e.fullPath);
+        if (names.empty()) continue; // 根目录
+        int node = 0;
+        for (auto iter = names.begin(); iter != names.end(); ++iter)
+        {
+            if (!nodes[node].isDir || !checkName(*iter)) return false;
+            bool last = std::next(iter) == names.end();
+            auto& children = nodes[node].children;
+            auto child = std::find_if(children.begin(), children.end(),
+                                      [&nodes, &iter](int c) { return nodes[c].name == *iter; });
+            if (child != children.end())
+            {
+                if (last && !(e.isDir && nodes[*child].isDir)) return false; // 重复的项目
+                node = *child;
+                continue;
+            }
+            if (children.size() == kMaxChildEntries) return false; // 目录项过多
+            int newNode = static_cast<int>(nodes.size());
+            children.push_back(newNode);
+            nodes.push_back({*iter, !last || e.isDir, last ? &e.data : nullptr, {}}); // 之后 children 失效
+            node = newNode;
+        }
+    }
+
+    std::lock_guard<std::shared_mutex> transactionLock(m_mutex0Transaction); // 期间没有其他线程修改文件系统
+    if (!initFileSystem()) return false;
+    std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
+    std::vector<char> tables(m_fat, m_fat + kFatSize); // 空文件系统的各表，空间不足时恢复
+    tables.insert(tables.end(), m_blockIndex, m_blockIndex + kFatSize);
+    tables.insert(tables.end(), m_refCount, m_refCount + kFatSize);
+
+    // 规划布局：从根目录块之后顺序分配，跳过坏块和日志
+    std::vector<char> image(kFatSize * kBlockSize, 0);
+    std::vector<bool> written(kFatSize, false); // 要写入的块
+    int cursor = kRootBlockNumber + 1;
+    auto allocate = [this, &cursor](int index) {
+        while (cursor < kFatSize && m_fat[cursor] != 0)
+        {
+            ++cursor;
+        }
+        if (cursor == kFatSize) return -1;
+        m_fat[cursor] = -1;
+        m_blockIndex[cursor] = static_cast<char>(index);
+        m_refCount[cursor] = 1;
+        return cursor++;
+    };
+    std::function<bool(int, int)> place = [&](int node, int dirBlock) {
+        char* dir = image.data() + kBlockSize * dirBlock;
+        for (int i = 0; i != kMaxChildEntries; ++i)
+        {
+            dir[kEntrySize * i] = '$'; // 所有的目录项都为空
+        }
+        auto children = nodes[node].children;
+        std::stable_partition(children.begin(), children.end(), [&nodes](int c) { return !nodes[c].isDir; });
+        for (int i = 0; i != static_cast<int>(children.size()); ++i)
+        {
+            const Node& child = nodes[children[i]];
+            char* entryPointer = dir + kEntrySize * i;
+            setNameToEntryPointer(entryPointer, child.name);
+            if (child.isDir)
+            {
+                int block = allocate(0);
+                if (block < 0) return false;
+                entryPointer[kEntryAttributesIndex] = Directory;
+                entryPointer[kEntryBlockStartIndex] = block;
+                setSizeToEntryPointer(entryPointer, 0);
+                written[block] = true;
+                if (!place(children[i], block)) return false;
+                continue;
+            }
+            int size = static_cast<int>(child.data->size());
+            if (size != 0 && size <= kMaxInlineSize)
+            {
+                setInlineDataToEntryPointer(entryPointer, File, child.data->data(), size);
+                continue;
+            }
+            // 文件的块连续分配，依次链接
+            int firstBlock = -1;
+            int previous = -1;
+            for (int index = 0; index * kBlockSize < size; ++index)
+            {
+                int block = allocate(index);
+                if (block < 0) return false;
+                int end = std::min(size, (index + 1) * kBlockSize);
+                std::copy(child.data->data() + index * kBlockSize, child.data->data() + end,
+                          image.data() + kBlockSize * block);
+                written[block] = true;
+                if (previous < 0) firstBlock = block;
+                else m_fat[previous] = block;
+                previous = block;
+            }
+            entryPointer[kEntryAttributesIndex] = File;
+            entryPointer[kEntryBlockStartIndex] = firstBlock;
+            setSizeToEntryPointer(entryPointer, size);
+        }
+        return true;
+    };
+    if (!place(0, kRootBlockNumber)) // 空间不足
+    {
+        std::copy(tables.begin(), tables.begin() + kFatSize, m_fat);
+        std::copy(tables.begin() + kFatSize, tables.begin() + kFatSize * 2, m_blockIndex);
+        std::copy(tables.begin() + kFatSize * 2, tables.end(), m_refCount);
+        return false;
+    }
+
+    // 连续的块一次写入，不经过调度器；这些块在提交之前都还没有被引用
+    for (int block = kRootBlockNumber + 1; block != kFatSize;)
+    {
+        if (!written[block])
+        {
+            ++block;
+            continue;
+        }
+        int end = block;
+        while (end != kFatSize && written[end])
+        {
+            ++end;
+        }
+        if (!m_disk.write(image.data() + kBlockSize * block, block, end - block)) return false;
+        for (; block != end; ++block)
+        {
+            m_checksums[block] = toyfs::crc32c(image.data() + kBlockSize * block, kBlockSize);
+            m_checksumDirty[block / kChecksumsPerBlock] = true;
+        }
+    }
+
+    // 数据持久化之后，根目录块和各表作为一条日志记录提交
+    if (!sync()) return false;
+    return commitMetadata({{kRootBlockNumber, image.data() + kBlockSize * kRootBlockNumber}}, true);
+}
+
 std::shared_ptr<Entry> FileSystem::rootEntry()
 {
     return m_rootEntry;
@@ -90,6 +312,7 @@ std::shared_ptr<Entry> FileSystem::rootEntry()
 
 std::shared_ptr<Entry> FileSystem::getEntry(const std::string& fullPath)
 {
+    TraceScope trace(*this, toyfs::TraceOp::GetEntry, fullPath);
     if (fullPath[0] != '/') return nullptr; // 不是绝对路径
 
     auto names = splitPath(fullPath);
@@ -106,11 +329,14 @@ std::shared_ptr<Entry> FileSystem::getEntry(const std::string& fullPath)
 
 bool FileSystem::exist(const std::string& fullPath)
 {
+    TraceScope trace(*this, toyfs::TraceOp::Exist, fullPath);
     return getEntry(fullPath) != nullptr;
 }
 
 bool FileSystem::createDir(const std::string& fullPath)
 {
+    TraceScope trace(*this, toyfs::TraceOp::CreateDir, fullPath);
+    UpdateLock updateLock(*this);
     if (exist(fullPath)) return false; // 目标已存在
     std::string parentPath = fullPath.substr(0, fullPath.find_last_of('/'));
     if (parentPath == "") // 父目录是根目录
@@ -121,43 +347,43 @@ bool FileSystem::createDir(const std::string& fullPath)
     if (!checkName(dirName)) return false; // 名称不合法
     if (!exist(parentPath)) return false;  // 父目录不存在
     auto parent = getEntry(parentPath);
-    if (parent->getChildren().size() == kMaxChildEntries) return false; // 父目录子项数超限制
+    if (!parent->isDir()) return false; // 父目录不存在（不是目录）
 
-    std::lock_guard<std::mutex> fatLock(m_mutex1Fat);
-    std::lock_guard<std::mutex> bufferLock(m_mutex2Buffer);
+    // 父目录的写锁保证检查和修改之间没有其他线程改动父目录
+    std::lock_guard<std::shared_mutex> dirLock(m_dirLocks[parent->m_blockStart]);
+    char buffer[kBlockSize];
+    if (!readBlock(buffer, parent->m_blockStart)) return false;
+    if (findChildEntryPointer(buffer, dirName) != nullptr) return false; // 目标已存在
+    char* entryPointer = findChildEntryPointer(buffer, "");              // 一个空目录项指针
+    if (entryPointer == nullptr) return false;                           // 父目录子项数超限制
+
+    std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
 
     int blockNumber;
     if ((blockNumber = nextAvailableBlock()) < 0) return false; // 没有足够的块可供分配
 
     // 填充目录项
+    char dirBuffer[kBlockSize];
     for (int i = 0; i != kMaxChildEntries; ++i)
     {
-        m_buffer[kEntrySize * i] = '$'; // 所有的目录项都为空
+        dirBuffer[kEntrySize * i] = '$'; // 所有的目录项都为空
     }
-    if (!m_disk.write(m_buffer, blockNumber)) return false;
 
     // 修改父目录项
-
-    if (!m_disk.read(m_buffer, parent->m_blockStart)) return false;
-    char* entryPointer = findChildEntryPointer(m_buffer, ""); // 一个空目录项指针
     // 填充目录名
-    for (size_t i = 0; i != dirName.length(); ++i)
-    {
-        entryPointer[i] = dirName[i];
-    }
-    entryPointer[dirName.length()] = '$'; // 设置文件名结束标志
+    setNameToEntryPointer(entryPointer, dirName);
     // 填充其余信息
     entryPointer[kEntryAttributesIndex] = FileSystem::Directory;
     entryPointer[kEntryBlockStartIndex] = blockNumber;
-    entryPointer[kEntryNumOfBlocksIndex] = 0;
-    // 写入磁盘
-    if (!m_disk.write(m_buffer, parent->m_blockStart)) return false;
+    setSizeToEntryPointer(entryPointer, 0);
 
     // 修改 FAT
     m_fat[blockNumber] = -1;
-    if (!saveFat()) return false;
+    m_blockIndex[blockNumber] = 0;
+    m_refCount[blockNumber] = 1;
 
-    if (!sync()) return false; // 更改持久化
+    // 新目录块、父目录块和 FAT 作为一条日志记录提交，新目录还不可见，不需要加锁
+    if (!commitMetadata({{blockNumber, dirBuffer}, {parent->m_blockStart, buffer}}, true)) return false;
 
     return true;
     // todo 适应可变 sector size
@@ -173,6 +399,8 @@ bool FileSystem::createDir(std::shared_ptr<Entry> parent, const std::string& dir
 
 bool FileSystem::createFile(const std::string& fullPath, FileSystem::Attributes attributes)
 {
+    TraceScope trace(*this, toyfs::TraceOp::CreateFile, fullPath, 0, attributes);
+    UpdateLock updateLock(*this);
     if (exist(fullPath)) return false; // 目标已存在
     std::string parentPath = fullPath.substr(0, fullPath.find_last_of('/'));
     if (parentPath == "") // 父目录是根目录
@@ -190,40 +418,25 @@ bool FileSystem::createFile(const std::string& fullPath, FileSystem::Attributes
     if ((attributes & FileSystem::Directory)) return false;             // 不允许为目录
 
     {
-        std::lock_guard<std::mutex> fatLock(m_mutex1Fat);
-        std::lock_guard<std::mutex> bufferLock(m_mutex2Buffer);
-
-        int blockNumber;
-        if ((blockNumber = nextAvailableBlock()) < 0) return false; // 没有足够的块可供分配
-
-        // 填充文件内容
-        m_buffer[0] = END_OF_FILE;
-        if (!m_disk.write(m_buffer, blockNumber)) return false;
+        // 新文件是空的，不分配块也不修改 FAT，写入数据时再分配块或内嵌在目录项中
+        std::lock_guard<std::shared_mutex> dirLock(m_dirLocks[parent->m_blockStart]);
 
         // 修改父目录项
-
-        if (!m_disk.read(m_buffer, parent->m_blockStart)) return false;
-        char* entryPointer = findChildEntryPointer(m_buffer, ""); // 一个空目录项指针
+        char buffer[kBlockSize];
+        if (!readBlock(buffer, parent->m_blockStart)) return false;
+        if (findChildEntryPointer(buffer, fileName) != nullptr) return false; // 目标已存在
+        char* entryPointer = findChildEntryPointer(buffer, "");               // 一个空目录项指针
+        if (entryPointer == nullptr) return false;                            // 父目录子项数超限制
         // 填充文件名
-        for (size_t i = 0; i != fileName.length(); ++i)
-        {
-            entryPointer[i] = fileName[i];
-        }
-        entryPointer[fileName.length()] = '$'; // 设置文件名结束标志
+        setNameToEntryPointer(entryPointer, fileName);
         // 填充其余信息
         entryPointer[kEntryAttributesIndex] = attributes;
-        entryPointer[kEntryBlockStartIndex] = blockNumber;
-        entryPointer[kEntryNumOfBlocksIndex] = 1;
-        // 写入磁盘
-        if (!m_disk.write(m_buffer, parent->m_blockStart)) return false;
-
-        // 修改 FAT
-        m_fat[blockNumber] = -1;
-        if (!saveFat()) return false;
+        entryPointer[kEntryBlockStartIndex] = -1;
+        setSizeToEntryPointer(entryPointer, 0);
+        // 通过日志提交
+        if (!commitMetadata({{parent->m_blockStart, buffer}}, false)) return false;
     } // 释放锁
 
-    if (!sync()) return false; // 更改持久化
-
     // 顺便打开文件，是否成功不打紧
     openFile(fullPath, Read | Write);
 
@@ -241,331 +454,2184 @@ bool FileSystem::createFile(std::shared_ptr<Entry> parent, const std::string& fi
 
 bool FileSystem::openFile(const std::string& fullPath, FileSystem::OpenModes openModes)
 {
-    if (isOpened(fullPath)) return true;                       // 已经打开
-    if (m_openedFiles.size() == kMaxOpenedFiles) return false; // 打开文件数量超限制
-    if (!exist(fullPath)) return false;                        // 文件不存在
-    auto fileEntry = getEntry(fullPath);
-    if ((fileEntry->m_attributes & ReadOnly) && (openModes & Write)) return false; // 不能以写方式打开只读文件
+    TraceScope trace(*this, toyfs::TraceOp::OpenFile, fullPath, 0, openModes);
+    return openFileDescriptor(fullPath, openModes, false) >= 0;
+}
 
-    // 获取信息
-    int blockStart = fileEntry->m_blockStart;
-    int numOfBlock = fileEntry->m_numBlock;
+bool FileSystem::closeFile(const std::string& fullPath)
+{
+    TraceScope trace(*this, toyfs::TraceOp::CloseFile, fullPath);
+    int fd;
+    {
+        FdShard& shard = fdShardOf(fullPath);
+        std::lock_guard<std::mutex> shardLock(shard.mutex);
+        auto iter = shard.paths.find(fullPath);
+        if (iter == shard.paths.end()) return false;
+        fd = iter->second;
+    }
+    return close(fd);
+}
+
+int FileSystem::open(const std::string& fullPath, FileSystem::OpenModes openModes)
+{
+    TraceScope trace(*this, toyfs::TraceOp::Open, fullPath, 0, openModes);
+    int fd = openFileDescriptor(fullPath, openModes, true);
+    trace.setHandle(fd);
+    return fd;
+}
 
-    std::lock_guard<std::mutex> bufferLock(m_mutex2Buffer);
+int FileSystem::openFileDescriptor(const std::string& fullPath, OpenModes openModes, bool addReference)
+{
+    UpdateLock updateLock(*this);
+    // 整个打开过程都持有分片锁，保证同一路径只会生成一个描述符
+    FdShard& shard = fdShardOf(fullPath);
+    int shardIndex = static_cast<int>(&shard - m_fdShards);
+    std::lock_guard<std::mutex> shardLock(shard.mutex);
+
+    auto iter = shard.paths.find(fullPath);
+    if (iter != shard.paths.end()) // 已经打开
+    {
+        if (addReference) ++shard.slots[iter->second / kNumOfFdShards]->refCount;
+        return iter->second;
+    }
+    if (shard.freeSlots.empty() && shard.slots.size() == kMaxSlotsPerShard) return -1; // 打开文件数量超限制
+    auto fileEntry = getEntry(fullPath);
+    if (fileEntry == nullptr) return -1;                                          // 文件不存在
+    if ((fileEntry->m_attributes & ReadOnly) && (openModes & Write)) return -1; // 不能以写方式打开只读文件
 
-    if (!m_disk.read(m_buffer, findNextNBlock(blockStart, numOfBlock - 1))) return false;
-    int tailLength = 0;
-    for (; m_buffer[tailLength] != END_OF_FILE; ++tailLength)
+    // 获取信息，文件大小直接取自目录项
+    int blockStart = fileEntry->m_blockStart;
+    int size = fileEntry->m_size;
+    int numOfBlock = 0;
+    ChainPosition tail = {-1, -1}; // 块链的尾部，缓存下来供追加写使用
     {
-        /* empty */
+        std::shared_lock<std::shared_mutex> fatLock(m_mutex1Fat);
+        for (int block = blockStart; block >= 0; block = m_fat[block])
+        {
+            ++numOfBlock;
+            tail = {blockIndex(block), block};
+        }
     }
-    int length = kBlockSize * (numOfBlock - 1) + tailLength;
 
-    // 加入打开列表
+    // 生成文件描述符
     std::shared_ptr<OpenedFile> of = std::make_shared<OpenedFile>();
     of->fullPath = fullPath;
     of->attributes = fileEntry->m_attributes;
     of->blockNumber = blockStart;
     of->numOfBlocks = numOfBlock;
+    of->size = size;
     of->modes = openModes;
     of->g = 0;
-    of->p = length;
-    m_openedFiles.insert({fullPath, of});
+    of->p = size;
+    of->cached = tail;
+    of->parentBlock = fileEntry->parent()->m_blockStart;
+    of->entryIndex = fileEntry->m_entryIndex;
+    of->inlined = !fileEntry->m_inlineData.empty();
+    std::copy(fileEntry->m_inlineData.begin(), fileEntry->m_inlineData.end(), of->inlineData);
+    of->refCount = 1;
+
+    // 加入打开列表，优先复用空闲槽位
+    int slot;
+    if (shard.freeSlots.empty())
+    {
+        slot = static_cast<int>(shard.slots.size());
+        shard.slots.push_back(of);
+    }
+    else
+    {
+        slot = shard.freeSlots.back();
+        shard.freeSlots.pop_back();
+        shard.slots[slot] = of;
+    }
+    int fd = slot * kNumOfFdShards + shardIndex;
+    shard.paths.insert({fullPath, fd});
 
-    return true;
+    return fd;
 }
 
-bool FileSystem::closeFile(const std::string& fullPath)
+bool FileSystem::close(int fd)
 {
-    // 等待缓存锁，即等待所有读写操作完成
-    std::lock_guard<std::mutex> bufferLock(m_mutex2Buffer); // lock buffer
+    TraceScope trace(*this, toyfs::TraceOp::Close, fd);
+    UpdateLock updateLock(*this);
+    if (fd < 0) return false;
+    FdShard& shard = m_fdShards[fd % kNumOfFdShards];
+    int slot = fd / kNumOfFdShards;
+
+    std::lock_guard<std::mutex> shardLock(shard.mutex);
+    if (slot >= static_cast<int>(shard.slots.size()) || shard.slots[slot] == nullptr) return false;
+    std::shared_ptr<OpenedFile> of = shard.slots[slot];
+    if (--of->refCount > 0) return true; // 还有其他引用
 
-    if (!sync()) return false; // 更改持久化
+    {
+        // 等待文件锁，即等待该文件所有读写操作完成
+        std::lock_guard<std::shared_mutex> fileLock(of->mutex);
+        if (!sync()) // 更改持久化
+        {
+            ++of->refCount;
+            return false;
+        }
+    }
 
-    auto iter = m_openedFiles.find(fullPath);
-    if (iter == m_openedFiles.end()) return false;
-    m_openedFiles.erase(iter);
+    shard.paths.erase(of->fullPath);
+    shard.slots[slot] = nullptr;
+    shard.freeSlots.push_back(slot);
 
     return true;
 }
 
-int FileSystem::readFile(const std::string& fullPath, char* buf_out, int length)
+std::unique_ptr<std::string> FileSystem::readFile(const std::string& fullPath, int length)
 {
-    if (!isOpened(fullPath)) // 文件没有打开
-    {
-        if (!openFile(fullPath, Read)) return 0; // 以读方式打开文件失败
-    }
-    std::shared_ptr<OpenedFile> fd = (m_openedFiles.find(fullPath))->second;
-    if (!(fd->modes & Read)) return 0; // 没有以读的方式打开文件
-
-    int rBlockNumber; // 当前读取的块号
-    int rp;           // 当前读取的块内指针
-
-    // 初始化刚开始的读取块号和块内指针
-    rBlockNumber = findNextNBlock(fd->blockNumber, fd->g / kBlockSize);
-    rp = fd->g % kBlockSize;
+    std::unique_ptr<std::string> ret(new std::string(std::max(length, 0), '\0'));
+    ret->resize(readFile(fullPath, &(*ret)[0], length));
+    return ret;
+}
 
-    int wp = 0; // write pointer on buffer
+int FileSystem::readFile(const std::string& fullPath, char* buf_out, int length)
+{
+    TraceScope trace(*this, toyfs::TraceOp::ReadFile, fullPath, length);
+    int fd = openFileDescriptor(fullPath, Read, false); // 文件没有打开则以读方式打开
+    if (fd < 0) return 0;                               // 打开文件失败
+    return read(fd, buf_out, length);
+}
 
-    while (wp < length)
-    {
-        std::lock_guard<std::mutex> bufferLock(m_mutex2Buffer);
-        if (!m_disk.read(m_buffer, rBlockNumber)) break;
-        while (wp < length && rp < kBlockSize)
-        {
-            if (m_buffer[rp] == END_OF_FILE)
-            {
-                goto read_end;
-            }
-            buf_out[wp++] = m_buffer[rp++];
-            ++fd->g;
-        }
-        rBlockNumber = findNextNBlock(rBlockNumber, 1); // 找到下一文件块序号
-        rp = 0;                                         // 重置 rp，从下一文件块的头部开始
-    }
-read_end:
-    return wp;
+int FileSystem::read(int fd, char* buf_out, int length)
+{
+    TraceScope trace(*this, toyfs::TraceOp::Read, fd, 0, length);
+    auto of = getOpenedFile(fd);
+    if (of == nullptr) return 0;
+    if (!(of->modes & Read)) return 0; // 没有以读的方式打开文件
+
+    std::lock_guard<std::shared_mutex> fileLock(of->mutex);
+
+    IoVec iov = {buf_out, length};
+    int n = of->inlined ? readInline(of->inlineData, of->size, of->g, &iov, 1)
+                        : readData(of->attributes, of->blockNumber, of->size, of->cached, of->g, &iov, 1);
+    of->g += n;
+    return n;
 }
 
-bool FileSystem::writeFile(const std::string& fullPath, const char* buffer, int length)
+int FileSystem::readAt(int fd, int offset, char* buf_out, int length)
 {
-    if (!isOpened(fullPath)) // 文件没有打开
-    {
-        if (!openFile(fullPath, Read | Write)) return false; // 以写方式打开文件失败
-    }
-    std::shared_ptr<OpenedFile> fd = (m_openedFiles.find(fullPath))->second;
-    if (!(fd->modes & Write)) return false; // 文件不是以写方式打开的
+    TraceScope trace(*this, toyfs::TraceOp::ReadAt, fd, offset, length);
+    auto of = getOpenedFile(fd);
+    if (of == nullptr) return 0;
+    if (!(of->modes & Read)) return 0; // 没有以读的方式打开文件
+    if (offset < 0) return 0;
+
+    // 持有文件的读锁，与写者互斥；使用局部的块链位置，多个读者可以并行
+    std::shared_lock<std::shared_mutex> fileLock(of->mutex);
+
+    IoVec iov = {buf_out, length};
+    if (of->inlined) return readInline(of->inlineData, of->size, offset, &iov, 1);
+    ChainPosition pos = {-1, -1}; // 文件开头可能是空洞，从链头之前开始找
+    return readData(of->attributes, of->blockNumber, of->size, pos, offset, &iov, 1);
+}
 
-    int wBlockNumber; // 当前写入的块号
-    int wp;           // 当前写入的块内指针
+int FileSystem::readv(int fd, const IoVec* iov, int iovcnt)
+{
+    TraceScope trace(*this, toyfs::TraceOp::Readv, fd, 0, totalLength(iov, iovcnt), iovcnt);
+    auto of = getOpenedFile(fd);
+    if (of == nullptr) return 0;
+    if (!(of->modes & Read)) return 0; // 没有以读的方式打开文件
 
-    // 初始化刚开始的读取块号和块内指针
-    wBlockNumber = findNextNBlock(fd->blockNumber, fd->p / kBlockSize);
-    wp = fd->p % kBlockSize;
+    std::lock_guard<std::shared_mutex> fileLock(of->mutex);
 
-    // 给被写入数据未尾追加 END_OF_FILE
-    std::string buf_in(buffer, buffer + length);
-    ++length;
-    buf_in.push_back(END_OF_FILE);
+    int n = of->inlined ? readInline(of->inlineData, of->size, of->g, iov, iovcnt)
+                        : readData(of->attributes, of->blockNumber, of->size, of->cached, of->g, iov, iovcnt);
+    of->g += n;
+    return n;
+}
 
-    int rp = 0; // read pointer on buffer
+bool FileSystem::writeFile(const std::string& fullPath, const char* buffer, int length)
+{
+    TraceScope trace(*this, toyfs::TraceOp::WriteFile, fullPath, length);
+    int fd = openFileDescriptor(fullPath, Read | Write, false); // 文件没有打开则以写方式打开
+    if (fd < 0) return false;                                   // 打开文件失败
+    return write(fd, buffer, length);
+}
 
-    while (rp < length)
-    {
-        std::lock_guard<std::mutex> lock1(m_mutex1Fat);
-        std::lock_guard<std::mutex> lock2(m_mutex2Buffer);
-        if (!m_disk.read(m_buffer, wBlockNumber)) break; // 先读入缓存
-        while (rp < length && wp < kBlockSize)
-        {
-            m_buffer[wp++] = buf_in[rp++];
-            ++fd->p;
-        }
-        if (!m_disk.write(m_buffer, wBlockNumber)) break; // 缓存满，写入磁盘
+bool FileSystem::write(int fd, const char* buffer, int length)
+{
+    TraceScope trace(*this, toyfs::TraceOp::Write, fd, 0, length);
+    UpdateLock updateLock(*this);
+    auto of = getOpenedFile(fd);
+    if (of == nullptr) return false;
+    if (!(of->modes & Write)) return false; // 文件不是以写方式打开的
+
+    std::lock_guard<std::shared_mutex> fileLock(of->mutex);
+
+    IoVec iov = {const_cast<char*>(buffer), length}; // 写操作只会读取数据段
+    int n = writeData(*of, of->p, &iov, 1);
+    of->p += n;
+    return n == length;
+}
 
-        // 已经写完一个块，如果还有数据要写则分配新块
-        if (rp == length) break; // 没有更多数据，结束
-        int previousNumber = wBlockNumber;
-        wBlockNumber = nextAvailableBlock();  // 找到下一文件块序号
-        if (wBlockNumber == -1) return false; // 没有新块可供分配
+bool FileSystem::writeAt(int fd, int offset, const char* buffer, int length)
+{
+    TraceScope trace(*this, toyfs::TraceOp::WriteAt, fd, offset, length);
+    UpdateLock updateLock(*this);
+    auto of = getOpenedFile(fd);
+    if (of == nullptr) return false;
+    if (!(of->modes & Write)) return false; // 文件不是以写方式打开的
+    if (offset < 0) return false;
 
-        // 修改 FAT
-        m_fat[previousNumber] = wBlockNumber;
-        m_fat[wBlockNumber] = -1;
-        saveFat(); // 保存 FAT
+    std::lock_guard<std::shared_mutex> fileLock(of->mutex);
 
-        // 修改对应父目录项内记录的文件大小
-        auto fileEntry = getEntry(fullPath);
-        auto parentEntry = fileEntry->parent();
-        if (!m_disk.read(m_buffer, parentEntry->m_blockStart)) break;
-        char* fileEntryPointer = findChildEntryPointer(m_buffer, fileEntry->name());
-        ++fileEntryPointer[kEntryNumOfBlocksIndex];
-        if (!m_disk.write(m_buffer, parentEntry->m_blockStart)) break;
+    IoVec iov = {const_cast<char*>(buffer), length}; // 写操作只会读取数据段
+    return writeData(*of, offset, &iov, 1) == length;
+}
 
-        wp = 0; // 重置 rp，从下一文件块的头部开始
-    }
+bool FileSystem::writev(int fd, const IoVec* iov, int iovcnt)
+{
+    TraceScope trace(*this, toyfs::TraceOp::Writev, fd, 0, totalLength(iov, iovcnt), iovcnt);
+    UpdateLock updateLock(*this);
+    auto of = getOpenedFile(fd);
+    if (of == nullptr) return false;
+    if (!(of->modes & Write)) return false; // 文件不是以写方式打开的
 
-    --fd->p; // 前面记多了一次 END_OF_FILE 的写入
+    std::lock_guard<std::shared_mutex> fileLock(of->mutex);
 
-    return true;
+    int n = writeData(*of, of->p, iov, iovcnt);
+    of->p += n;
+    return n == totalLength(iov, iovcnt);
 }
 
 bool FileSystem::setFileAttributes(const std::string& fullPath, FileSystem::Attributes attributes)
 {
+    TraceScope trace(*this, toyfs::TraceOp::SetFileAttributes, fullPath, 0, attributes);
+    UpdateLock updateLock(*this);
     if (!exist(fullPath)) return false;
     auto entry = getEntry(fullPath);
     if (entry->isDir()) return false;     // 不能为目录设置属性
     if (isOpened(fullPath)) return false; // 文件已被打开，不能改属性
 
-    attributes &= ReadOnly | System | File; // 只保留有效的属性
+    attributes &= ReadOnly | System | File | Compressed; // 只保留有效的属性
 
     if (!(attributes & File)) return false; // 新属性中不能没有文件属性
 
-    std::lock_guard<std::mutex> bufferLock(m_mutex2Buffer); // lock buffer
+    // 数据的存储格式随压缩属性改变，只有空文件可以改变压缩属性
+    bool formatChanged = (attributes ^ entry->m_attributes) & Compressed;
+    if (formatChanged && entry->m_size != 0) return false;
 
     auto parentEntry = entry->parent();
-    if (!m_disk.read(m_buffer, parentEntry->m_blockStart)) return false;
-    char* fileEntryPointer = findChildEntryPointer(m_buffer, entry->name());
-    fileEntryPointer[kEntryAttributesIndex] = attributes;
-    if (!m_disk.write(m_buffer, parentEntry->m_blockStart)) return false;
-
-    if (!sync()) return false;
+    std::lock_guard<std::shared_mutex> dirLock(m_dirLocks[parentEntry->m_blockStart]);
+    std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
+
+    char buffer[kBlockSize];
+    if (!readBlock(buffer, parentEntry->m_blockStart)) return false;
+    char* fileEntryPointer = findChildEntryPointer(buffer, entry->name());
+    if (fileEntryPointer == nullptr) return false; // 已被其他线程删除
+    int blockStart = getBlockStartFromEntryPointer(fileEntryPointer);
+    int inlineBits = fileEntryPointer[kEntryAttributesIndex] & ~(kInlineFlag - 1); // 保留内嵌标志和字节数
+    fileEntryPointer[kEntryAttributesIndex] = attributes | inlineBits;
+    if (formatChanged) // 释放空文件原有的块
+    {
+        fileEntryPointer[kEntryBlockStartIndex] = -1;
+    }
+    bool fatChanged = formatChanged && blockStart >= 0;
+    if (fatChanged) releaseChain(blockStart);
+    if (!commitMetadata({{parentEntry->m_blockStart, buffer}}, fatChanged)) return false;
 
     return true;
 }
 
-bool FileSystem::deleteEntry(const std::string& fullPath)
+bool FileSystem::stat(const std::string& fullPath, FileSystem::Stat& st)
 {
-    if (!exist(fullPath)) return false;
-
+    TraceScope trace(*this, toyfs::TraceOp::Stat, fullPath);
     auto entry = getEntry(fullPath);
-    if (entry->isDir()) // 是目录
+    if (entry == nullptr) return false;
+
+    st.attributes = entry->m_attributes;
+    st.size = entry->m_size;
+    st.numOfBlocks = 0;
     {
-        if (entry->getChildren().size() != 0)
+        std::shared_lock<std::shared_mutex> fatLock(m_mutex1Fat);
+        for (int block = entry->m_blockStart; block >= 0; block = m_fat[block])
         {
-            return false; // 不能删除非空目录
+            ++st.numOfBlocks;
         }
     }
-    else // 是文件
-    {
-        if (isOpened(fullPath)) return false; // 不能删除已打开文件
-    }
+    st.compressionRatio = compressionRatio(st);
 
-    std::lock_guard<std::mutex> fatLock(m_mutex1Fat);
-    std::lock_guard<std::mutex> bufferLock(m_mutex2Buffer);
-
-    // 删除目录项
-    auto parentEntry = entry->parent();
-    if (!m_disk.read(m_buffer, parentEntry->m_blockStart)) return false;
-    char* fileEntryPointer = findChildEntryPointer(m_buffer, entry->name());
-    fileEntryPointer[0] = '$'; // 设该目录项为空目录项
-    if (!m_disk.write(m_buffer, parentEntry->m_blockStart)) return false;
+    return true;
+}
 
-    // 释放 FAT
-    int blockNumber = entry->m_blockStart;
-    do
-    {
-        int next = m_fat[blockNumber];
-        m_fat[blockNumber] = 0;
-        blockNumber = next;
-    } while (m_fat[blockNumber] != -1);
-    if (!saveFat()) return false;
+bool FileSystem::stat(int fd, FileSystem::Stat& st)
+{
+    TraceScope trace(*this, toyfs::TraceOp::Stat, fd);
+    auto of = getOpenedFile(fd);
+    if (of == nullptr) return false;
 
-    if (!sync()) return false;
+    std::shared_lock<std::shared_mutex> fileLock(of->mutex);
+    st.attributes = of->attributes;
+    st.size = of->size;
+    st.numOfBlocks = of->numOfBlocks;
+    st.compressionRatio = compressionRatio(st);
 
     return true;
 }
 
-bool FileSystem::deleteEntry(std::shared_ptr<Entry> entry)
+bool FileSystem::clone(const std::string& srcPath, const std::string& dstPath)
 {
-    return deleteEntry(entry->fullpath());
-}
+    TraceScope trace(*this, toyfs::TraceOp::Clone, srcPath);
+    trace.setPath2(dstPath);
+    UpdateLock updateLock(*this);
+    // 源文件已打开时持有它的写锁，保证克隆期间没有写入，目录项也是最新的
+    std::shared_ptr<OpenedFile> srcFile;
+    {
+        FdShard& shard = fdShardOf(srcPath);
+        std::lock_guard<std::mutex> shardLock(shard.mutex);
+        auto iter = shard.paths.find(srcPath);
+        if (iter != shard.paths.end()) srcFile = shard.slots[iter->second / kNumOfFdShards];
+    }
+    std::unique_lock<std::shared_mutex> srcLock;
+    if (srcFile != nullptr) srcLock = std::unique_lock<std::shared_mutex>(srcFile->mutex);
 
-bool FileSystem::sync()
-{
-    return m_disk.sync();
-}
+    auto src = getEntry(srcPath);
+    if (src == nullptr || src->isDir()) return false; // 源文件不存在
+    if (exist(dstPath)) return false;                 // 目标已存在
+    std::string parentPath = dstPath.substr(0, dstPath.find_last_of('/'));
+    if (parentPath == "") // 父目录是根目录
+    {
+        parentPath = "/";
+    }
+    std::string fileName = dstPath.substr(dstPath.find_last_of('/') + 1);
+    if (!checkName(fileName)) return false; // 文件名不合法
+    auto parent = getEntry(parentPath);
+    if (parent == nullptr || !parent->isDir()) return false; // 父目录不存在
 
-bool FileSystem::loadFat()
-{
-    return m_disk.read(m_fat, 0) && m_disk.read(m_fat + Disk::kSectorSize, 1);
-}
+    {
+        std::lock_guard<std::shared_mutex> dirLock(m_dirLocks[parent->m_blockStart]);
+        std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
+        if (src->m_blockStart >= 0 && m_refCount[src->m_blockStart] >= kMaxRefCount)
+        {
+            return false; // 链头的引用计数已满，再增加会溢出
+        }
 
-bool FileSystem::saveFat()
-{
-    return m_disk.write(m_fat, 0) && m_disk.write(m_fat + Disk::kSectorSize, 1) && sync();
+        // 写入新的目录项，与源文件共享块链
+        char buffer[kBlockSize];
+        if (!readBlock(buffer, parent->m_blockStart)) return false;
+        if (findChildEntryPointer(buffer, fileName) != nullptr) return false; // 目标已存在
+        char* entryPointer = findChildEntryPointer(buffer, "");               // 一个空目录项指针
+        if (entryPointer == nullptr) return false;                            // 父目录子项数超限制
+        setNameToEntryPointer(entryPointer, fileName);
+        if (!src->m_inlineData.empty()) // 内嵌文件直接复制数据
+        {
+            setInlineDataToEntryPointer(entryPointer, src->m_attributes, src->m_inlineData.data(), src->m_size);
+        }
+        else
+        {
+            entryPointer[kEntryAttributesIndex] = src->m_attributes;
+            entryPointer[kEntryBlockStartIndex] = src->m_blockStart;
+            setSizeToEntryPointer(entryPointer, src->m_size);
+        }
+
+        // 增加链头的引用计数，与目录项作为一条日志记录提交
+        if (src->m_blockStart >= 0) ++m_refCount[src->m_blockStart];
+        return commitMetadata({{parent->m_blockStart, buffer}}, true);
+    } // 释放锁
 }
 
-int FileSystem::nextAvailableBlock()
+std::shared_ptr<Snapshot> FileSystem::snapshot()
 {
-    for (int i = 0; i != kFatSize; ++i)
+    TraceScope internalCall; // 不记录
+    std::shared_ptr<Snapshot> snapshot(new Snapshot(*this));
+
+    // 与提交事务一样持有事务锁的写锁，正在进行的修改都已完成，期间也没有新的修改
+    // 之后写入数据块前都会先复制被快照共享的块，所以只需要复制目录块
+    std::lock_guard<std::shared_mutex> transactionLock(m_mutex0Transaction);
+
+    // 复制所有目录块
+    std::vector<int> pendingDirs = {kRootBlockNumber};
+    std::vector<int> chains;
+    while (!pendingDirs.empty())
     {
-        if (m_fat[i] == 0)
+        int dirBlock = pendingDirs.back();
+        pendingDirs.pop_back();
+        std::vector<char> buffer(kBlockSize);
+        if (!readBlock(buffer.data(), dirBlock)) return nullptr;
+        for (int i = 0; i != kMaxChildEntries; ++i)
         {
-            return i;
+            char* entryPointer = buffer.data() + kEntrySize * i;
+            if (!checkName(getNameFromEntryPointer(entryPointer))) continue; // 空目录项
+            if (entryPointer[kEntryAttributesIndex] & kInlineFlag) continue; // 内嵌文件的数据已在目录块中
+            int blockStart = getBlockStartFromEntryPointer(entryPointer);
+            if (getAttributesFromEntryPointer(entryPointer) & Directory)
+            {
+                pendingDirs.push_back(blockStart);
+            }
+            else if (blockStart >= 0)
+            {
+                chains.push_back(blockStart);
+            }
         }
+        snapshot->m_dirs[dirBlock] = std::move(buffer);
     }
-    return -1;
-}
 
-int FileSystem::findNextNBlock(int firstBlock, int n)
-{
-    int nextNBlock = firstBlock;
-    for (int i = 0; i < n; ++i)
+    // 引用各文件的链头，快照存在期间这些块被视为共享，不会被原地修改或回收
+    // 快照的引用只记在内存中，不需要提交
+    std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
+    for (int blockStart : chains)
     {
-        nextNBlock = m_fat[nextNBlock];
-        if (nextNBlock == -1) break;
+        ++m_snapshotPins[blockStart];
     }
-    return nextNBlock;
-}
+    snapshot->m_pinnedChains = std::move(chains);
+    return snapshot;
+} // 释放锁
 
-bool FileSystem::isOpened(const std::string& fullPath)
+std::unique_ptr<Transaction> FileSystem::beginTransaction()
 {
-    return m_openedFiles.find(fullPath) != std::end(m_openedFiles);
+    return std::unique_ptr<Transaction>(new Transaction(*this));
 }
 
-std::vector<std::string> FileSystem::getOpenedFiles()
+bool FileSystem::commitTransaction(const Transaction& transaction)
 {
-    std::vector<std::string> ret;
-    for (auto const& e : m_openedFiles)
+    // 持有事务锁的写锁，期间没有其他线程修改文件系统；事务中的操作调用公开接口时不再加锁
+    std::lock_guard<std::shared_mutex> transactionLock(m_mutex0Transaction);
+    t_updating.push_back(this);
+    m_transactionOwner = std::this_thread::get_id();
+
+    // 保存各表，失败时恢复
+    std::vector<char> tables(kFatSize * 3);
     {
-        ret.push_back((e.second)->fullPath);
+        std::shared_lock<std::shared_mutex> fatLock(m_mutex1Fat);
+        std::copy(m_fat, m_fat + kFatSize, tables.begin());
+        std::copy(m_blockIndex, m_blockIndex + kFatSize, tables.begin() + kFatSize);
+        std::copy(m_refCount, m_refCount + kFatSize, tables.begin() + kFatSize * 2);
     }
-    std::sort(ret.begin(), ret.end());
-    return ret;
-}
 
-std::string FileSystem::getNameFromEntryPointer(char* p)
-{
-    char* end = p;
-    for (; *end != '$'; ++end)
+    bool succeeded = true;
+    for (const auto& op : transaction.m_operations)
     {
+        switch (op.type)
+        {
+        case Transaction::Operation::CreateDir:
+            succeeded = createDir(op.fullPath);
+            break;
+        case Transaction::Operation::CreateFile:
+            succeeded = !isOpened(op.fullPath) && createFile(op.fullPath, op.attributes);
+            closeFile(op.fullPath); // createFile 顺便打开了文件
+            break;
+        case Transaction::Operation::WriteFile:
+        {
+            if (isOpened(op.fullPath)) // 不能修改事务之外打开的文件，撤销时无法恢复它的描述符
+            {
+                succeeded = false;
+                break;
+            }
+            int fd = open(op.fullPath, Write);
+            succeeded = fd >= 0 && write(fd, op.data.data(), static_cast<int>(op.data.size()));
+            close(fd);
+            break;
+        }
+        case Transaction::Operation::SetAttributes:
+            succeeded = setFileAttributes(op.fullPath, op.attributes);
+            break;
+        case Transaction::Operation::DeleteEntry:
+            succeeded = deleteEntry(op.fullPath);
+            break;
+        }
+        if (!succeeded) break;
     }
-    return std::string(p, end);
-}
+    m_transactionOwner = std::thread::id(); // 之后的提交直接写入日志
 
-char* FileSystem::findChildEntryPointer(char* parentEntryPointer, const std::string& childName)
-{
-    for (int i = 0; i != kMaxChildEntries; ++i)
     {
-        char* childEntryPointer = parentEntryPointer + kEntrySize * i;
-        auto name = getNameFromEntryPointer(childEntryPointer);
-        if (name == childName) // 找到对应的目录项
+        std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
+        if (succeeded)
         {
-            return childEntryPointer;
+            // 事务中删除的目录的块已经释放，不再提交
+            std::vector<MetadataBlock> blocks;
+            for (const auto& b : m_transactionBlocks)
+            {
+                if (m_fat[b.first] != 0) blocks.push_back({b.first, b.second.data()});
+            }
+            std::sort(blocks.begin(), blocks.end(),
+                      [](const MetadataBlock& a, const MetadataBlock& b) { return a.block < b.block; });
+            succeeded = commitMetadata(std::move(blocks), true);
+        }
+        if (!succeeded) // 撤销：恢复各表，事务中修改的目录块还没有写入磁盘，丢弃即可
+        {
+            std::copy(tables.begin(), tables.begin() + kFatSize, m_fat);
+            std::copy(tables.begin() + kFatSize, tables.begin() + kFatSize * 2, m_blockIndex);
+            std::copy(tables.begin() + kFatSize * 2, tables.end(), m_refCount);
         }
     }
-    return nullptr;
+    if (!succeeded) // 解压缓存中可能有撤销的数据
+    {
+        std::lock_guard<std::mutex> cacheLock(m_mutex3Cache);
+        m_unitCache.clear();
+        m_unitCacheIndex.clear();
+    }
+    m_transactionBlocks.clear();
+    std::fill(m_transactionFreed.begin(), m_transactionFreed.end(), false); // 提交后已经空闲，撤销后又回到链上
+    t_updating.pop_back();
+    return succeeded;
 }
 
-bool FileSystem::checkName(const std::string& name)
+bool FileSystem::inTransaction()
 {
-    return name.length() > 0 && name.length() < kRawFileNameLength && name.find_first_of('$') == std::string::npos;
+    return m_transactionOwner.load() == std::this_thread::get_id();
 }
 
-std::list<std::string> FileSystem::splitPath(const std::string& fullPath)
+FileSystem::UpdateLock::UpdateLock(FileSystem& fs) : m_fs(nullptr)
 {
-    std::list<std::string> names;
-    std::string name;
-    std::istringstream iss(fullPath);
-    while (getline(iss, name, '/'))
-    {
-        names.push_back(name);
-    }
-    if (names.front().length() == 0)
-    {
-        names.pop_front(); // 移除没有名字的根目录
-    }
-    return names;
+    if (std::find(t_updating.begin(), t_updating.end(), &fs) != t_updating.end()) return; // 已经持有
+    fs.m_mutex0Transaction.lock_shared();
+    t_updating.push_back(&fs);
+    m_fs = &fs;
 }
 
-std::vector<std::shared_ptr<Entry>> Entry::getChildren()
+FileSystem::UpdateLock::~UpdateLock()
+{
+    if (m_fs == nullptr) return;
+    t_updating.erase(std::find(t_updating.begin(), t_updating.end(), m_fs));
+    m_fs->m_mutex0Transaction.unlock_shared();
+}
+
+std::future<int> FileSystem::asyncRead(int fd, int offset, char* buf_out, int length)
+{
+    return runAsync([this, fd, offset, buf_out, length]() { return readAt(fd, offset, buf_out, length); });
+}
+
+std::future<bool> FileSystem::asyncWrite(int fd, int offset, const char* buf_in, int length)
+{
+    return runAsync([this, fd, offset, buf_in, length]() { return writeAt(fd, offset, buf_in, length); });
+}
+
+std::future<bool> FileSystem::asyncCreate(const std::string& fullPath, Attributes attributes)
+{
+    return runAsync([this, fullPath, attributes]() { return createFile(fullPath, attributes); });
+}
+
+std::future<std::shared_ptr<Entry>> FileSystem::asyncGetEntry(const std::string& fullPath)
+{
+    return runAsync([this, fullPath]() { return getEntry(fullPath); });
+}
+
+bool FileSystem::deleteEntry(const std::string& fullPath)
+{
+    TraceScope trace(*this, toyfs::TraceOp::DeleteEntry, fullPath);
+    UpdateLock updateLock(*this);
+    if (!exist(fullPath)) return false;
+
+    auto entry = getEntry(fullPath);
+    if (entry->isDir()) // 是目录
+    {
+        if (entry->getChildren().size() != 0)
+        {
+            return false; // 不能删除非空目录
+        }
+    }
+    else // 是文件
+    {
+        if (isOpened(fullPath)) return false; // 不能删除已打开文件
+    }
+
+    // 按父目录、目录本身的顺序加锁，在锁内重新检查
+    auto parentEntry = entry->parent();
+    std::lock_guard<std::shared_mutex> dirLock(m_dirLocks[parentEntry->m_blockStart]);
+    std::unique_lock<std::shared_mutex> childLock;
+    char buffer[kBlockSize];
+    if (entry->isDir())
+    {
+        childLock = std::unique_lock<std::shared_mutex>(m_dirLocks[entry->m_blockStart]);
+        if (!readBlock(buffer, entry->m_blockStart)) return false;
+        for (int i = 0; i != kMaxChildEntries; ++i)
+        {
+            if (checkName(getNameFromEntryPointer(buffer + kEntrySize * i))) return false; // 不能删除非空目录
+        }
+    }
+    std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
+
+    // 删除目录项
+    if (!readBlock(buffer, parentEntry->m_blockStart)) return false;
+    char* fileEntryPointer = findChildEntryPointer(buffer, entry->name());
+    if (fileEntryPointer == nullptr) return false; // 已被其他线程删除
+    int blockStart = getBlockStartFromEntryPointer(fileEntryPointer);
+    fileEntryPointer[0] = '$'; // 设该目录项为空目录项
+
+    // 释放 FAT，与其他文件共享的块只减少引用计数
+    releaseChain(blockStart);
+    if (!commitMetadata({{parentEntry->m_blockStart, buffer}}, true)) return false;
+
+    return true;
+}
+
+bool FileSystem::deleteEntry(std::shared_ptr<Entry> entry)
+{
+    return deleteEntry(entry->fullpath());
+}
+
+bool FileSystem::sync()
+{
+    TraceScope trace(*this, toyfs::TraceOp::Sync, -1);
+    if (inTransaction()) return true; // 事务中的修改在提交事务时一起持久化
+    return flush();
+}
+
+bool FileSystem::flush()
+{
+    // 组提交：调用者加入等待中的提交组，由一个线程为整组写回一次，完成后同时放行整组
+    // 正在写回的组不能再加入，它开始写回时可能还没有包含调用者的修改
+    std::unique_lock<std::mutex> commitLock(m_mutex5Commit);
+    ++m_commitStats.syncs;
+    if (m_pendingCommit == nullptr) m_pendingCommit = std::make_shared<CommitGroup>();
+    std::shared_ptr<CommitGroup> group = m_pendingCommit;
+    while (!group->done)
+    {
+        if (m_committing)
+        {
+            m_commitCond.wait(commitLock); // 等待上一组写回完成
+            continue;
+        }
+
+        // 没有正在写回的组，由本线程为整组写回
+        m_committing = true;
+        m_pendingCommit = nullptr; // 之后到达的调用者加入新的组
+        ++m_commitStats.flushes;
+        commitLock.unlock();
+        bool succeeded = flushChecksums() && m_disk.sync();
+        commitLock.lock();
+        group->succeeded = succeeded;
+        group->done = true;
+        m_committing = false;
+        m_commitCond.notify_all();
+    }
+    return group->succeeded;
+}
+
+bool FileSystem::fsck(FsckReport& report, bool repair)
+{
+    TraceScope internalCall; // 不记录
+    report = {0, 0, 0, 0, 0, 0, false};
+    std::lock_guard<std::shared_mutex> transactionLock(m_mutex0Transaction); // 期间没有其他线程修改文件系统
+    if (repair && !getOpenedFiles().empty()) return false; // 修复会改动已打开文件的目录项
+    std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
+
+    // 在副本上检查和修复，只检查时不修改文件系统
+    std::vector<char> fat(m_fat, m_fat + kFatSize);
+    std::vector<char> index(m_blockIndex, m_blockIndex + kFatSize);
+    std::vector<int> refs(kFatSize, 0);          // 实际的引用数：指向该块的目录项和 FAT 表项的个数
+    std::vector<bool> dirBlocks(kFatSize, false); // 被目录占用的块
+    std::vector<bool> walked(kFatSize, false);    // 已经检查过的文件块
+    auto isDataBlock = [this, &fat](int block) {
+        return block > kRootBlockNumber && block < kJournalBlockNumber && fat[block] != -2;
+    };
+
+    // 逐层扫描目录树，同一层的目录块并行读取，调度器会合并相邻的块
+    struct FileEntry
+    {
+        int dirBlock;
+        int entryIndex;
+    };
+    std::vector<FileEntry> fileEntries;
+    std::unordered_map<int, std::vector<char>> dirs; // 目录块号到目录块内容
+    std::vector<int> dirtyDirs;                      // 修改过的目录块
+    std::vector<int> level = {kRootBlockNumber};
+    dirBlocks[kRootBlockNumber] = true;
+    refs[kRootBlockNumber] = 1;
+    while (!level.empty())
+    {
+        // 在专用的线程上读取，不能交给工作线程：其中的修改操作在等待事务锁，排在它们之后的读取永远不会执行
+        std::sort(level.begin(), level.end());
+        std::vector<std::vector<char>> buffers(level.size(), std::vector<char>(kBlockSize));
+        int numOfThreads = static_cast<int>(level.size());
+        if (numOfThreads > kNumOfFsckThreads) numOfThreads = kNumOfFsckThreads;
+        std::vector<std::future<bool>> reads;
+        for (int t = 0; t != numOfThreads; ++t)
+        {
+            reads.push_back(std::async(std::launch::async, [this, &level, &buffers, numOfThreads, t]() {
+                bool readable = true;
+                for (size_t i = t; i < level.size(); i += numOfThreads)
+                {
+                    readable = readBlock(buffers[i].data(), level[i]) && readable;
+                }
+                return readable;
+            }));
+        }
+        bool readable = true;
+        for (auto& r : reads)
+        {
+            readable = r.get() && readable; // 等待所有的读取完成
+        }
+        if (!readable) return false; // 目录块已损坏
+
+        std::vector<int> nextLevel;
+        for (size_t i = 0; i != level.size(); ++i)
+        {
+            ++report.directories;
+            bool dirty = false;
+            for (int k = 0; k != kMaxChildEntries; ++k)
+            {
+                char* entryPointer = buffers[i].data() + kEntrySize * k;
+                if (!checkName(getNameFromEntryPointer(entryPointer))) continue; // 空目录项
+                int blockStart = getBlockStartFromEntryPointer(entryPointer);
+                if (!(getAttributesFromEntryPointer(entryPointer) & Directory))
+                {
+                    ++report.files;
+                    if (blockStart >= 0) fileEntries.push_back({level[i], k}); // 扫描完所有目录后再检查块链
+                    if (blockStart >= -1) continue;
+                    ++report.badEntries; // 无效的起始块号，清空文件
+                    entryPointer[kEntryBlockStartIndex] = -1;
+                    setSizeToEntryPointer(entryPointer, 0);
+                    dirty = true;
+                    continue;
+                }
+                if (!isDataBlock(blockStart) || dirBlocks[blockStart]) // 目录块无效或者已被其他目录占用，删除目录项
+                {
+                    ++report.badEntries;
+                    entryPointer[0] = '$';
+                    dirty = true;
+                    continue;
+                }
+                if (fat[blockStart] != -1) // FAT 中没有标记为目录占用的块，重新标记
+                {
+                    ++report.badEntries;
+                    fat[blockStart] = -1;
+                }
+                dirBlocks[blockStart] = true;
+                refs[blockStart] = 1;
+                nextLevel.push_back(blockStart);
+            }
+            if (dirty) dirtyDirs.push_back(level[i]);
+            dirs[level[i]] = std::move(buffers[i]);
+        }
+        level = std::move(nextLevel);
+    }
+
+    // 检查文件的块链，与其他文件共享的部分只检查一次
+    auto walkChain = [&](int block) {
+        if (walked[block]) return;
+        walked[block] = true;
+        for (int next = fat[block]; next != -1; next = fat[block])
+        {
+            // 逻辑块号沿块链递增，成环的块链一定在某处不递增
+            bool valid = isDataBlock(next) && fat[next] != 0 && !dirBlocks[next] &&
+                         static_cast<unsigned char>(index[next]) > static_cast<unsigned char>(index[block]);
+            if (!valid)
+            {
+                ++report.brokenChains;
+                fat[block] = -1; // 截断
+                break;
+            }
+            ++refs[next];
+            if (walked[next]) break; // 接入已经检查过的共享部分
+            walked[next] = true;
+            block = next;
+        }
+    };
+    for (const auto& fe : fileEntries)
+    {
+        char* entryPointer = dirs[fe.dirBlock].data() + kEntrySize * fe.entryIndex;
+        int block = getBlockStartFromEntryPointer(entryPointer);
+        if (!isDataBlock(block) || fat[block] == 0 || dirBlocks[block]) // 起始块无效、空闲或属于目录，清空文件
+        {
+            ++report.badEntries;
+            entryPointer[kEntryBlockStartIndex] = -1;
+            setSizeToEntryPointer(entryPointer, 0);
+            if (std::find(dirtyDirs.begin(), dirtyDirs.end(), fe.dirBlock) == dirtyDirs.end())
+            {
+                dirtyDirs.push_back(fe.dirBlock);
+            }
+            continue;
+        }
+        ++refs[block];
+        walkChain(block);
+    }
+    // 快照引用的块链也在使用，文件删除或改写后可能只剩快照引用；快照的引用不在引用计数表中，不计入 refs
+    for (int block = kRootBlockNumber + 1; block != kJournalBlockNumber; ++block)
+    {
+        if (m_snapshotPins[block] > 0 && fat[block] != 0 && !dirBlocks[block]) walkChain(block);
+    }
+
+    // 回收泄漏的块，改正引用计数
+    std::vector<char> refCount(m_refCount, m_refCount + kFatSize);
+    for (int block = kRootBlockNumber; block != kJournalBlockNumber; ++block)
+    {
+        if (fat[block] == -2) continue; // 坏块
+        if (!dirBlocks[block] && !walked[block] && fat[block] != 0)
+        {
+            ++report.leakedBlocks;
+            fat[block] = 0;
+            index[block] = 0;
+            refCount[block] = 0;
+            continue;
+        }
+        if (refCount[block] != refs[block])
+        {
+            ++report.refCountErrors;
+            refCount[block] = static_cast<char>(refs[block]);
+        }
+    }
+
+    bool consistent = report.badEntries + report.brokenChains + report.refCountErrors + report.leakedBlocks == 0;
+    if (consistent || !repair) return consistent;
+
+    // 修复：先提交修改过的目录块，再提交各表
+    std::copy(fat.begin(), fat.end(), m_fat);
+    std::copy(index.begin(), index.end(), m_blockIndex);
+    std::copy(refCount.begin(), refCount.end(), m_refCount);
+    for (int dirBlock : dirtyDirs)
+    {
+        if (!commitMetadata({{dirBlock, dirs[dirBlock].data()}}, false)) return false;
+    }
+    if (!saveFat()) return false;
+    {
+        std::lock_guard<std::mutex> cacheLock(m_mutex3Cache); // 截断或回收的块可能还在解压缓存中
+        m_unitCache.clear();
+        m_unitCacheIndex.clear();
+    }
+    report.repaired = true;
+    return true;
+}
+
+void FileSystem::setChecksumVerification(bool enabled)
+{
+    m_verifyChecksums = enabled;
+}
+
+FileSystem::ChecksumStats FileSystem::checksumStats()
+{
+    return {m_checksumsVerified.load(), m_checksumFailures.load()};
+}
+
+FileSystem::CommitStats FileSystem::commitStats()
+{
+    std::lock_guard<std::mutex> commitLock(m_mutex5Commit);
+    return m_commitStats;
+}
+
+FileSystem::CacheStats FileSystem::decompressionCacheStats()
+{
+    std::lock_guard<std::mutex> cacheLock(m_mutex3Cache);
+    return m_cacheStats;
+}
+
+void FileSystem::setIoLatencyBudget(int microseconds)
+{
+    m_scheduler.setLatencyBudget(std::chrono::microseconds(microseconds));
+}
+
+FileSystem::IoStats FileSystem::ioStats()
+{
+    return m_scheduler.stats();
+}
+
+bool FileSystem::startTrace(const std::string& path)
+{
+    auto writer = std::make_shared<toyfs::TraceWriter>(path);
+    if (!writer->isValid()) return false;
+    std::atomic_store(&m_trace, writer);
+    m_tracing = true;
+    return true;
+}
+
+void FileSystem::stopTrace()
+{
+    m_tracing = false;
+    std::atomic_store(&m_trace, std::shared_ptr<toyfs::TraceWriter>());
+}
+
+FileSystem::TraceScope::TraceScope()
+{
+    ++t_traceDepth;
+}
+
+FileSystem::TraceScope::TraceScope(FileSystem& fs, toyfs::TraceOp op, const std::string& path, int length, int flags) :
+    TraceScope(fs, op, -1, 0, length, flags)
+{
+    if (m_writer != nullptr) m_record.path = path;
+}
+
+FileSystem::TraceScope::TraceScope(FileSystem& fs, toyfs::TraceOp op, int handle, int offset, int length, int flags)
+{
+    if (t_traceDepth++ != 0 || !fs.m_tracing.load(std::memory_order_relaxed)) return; // 嵌套的调用或者没有在记录
+    m_writer = std::atomic_load(&fs.m_trace);
+    if (m_writer == nullptr) return;
+    m_record.op = op;
+    m_record.timestamp = m_writer->elapsed();
+    m_record.handle = handle;
+    m_record.offset = offset;
+    m_record.length = length;
+    m_record.flags = flags;
+}
+
+FileSystem::TraceScope::~TraceScope()
+{
+    --t_traceDepth;
+    if (m_writer == nullptr) return;
+    m_record.duration = m_writer->elapsed() - m_record.timestamp;
+    m_writer->append(std::move(m_record));
+}
+
+void FileSystem::TraceScope::setHandle(int handle)
+{
+    m_record.handle = handle;
+}
+
+void FileSystem::TraceScope::setPath2(const std::string& path2)
+{
+    if (m_writer != nullptr) m_record.path2 = path2;
+}
+
+bool FileSystem::loadFat()
+{
+    // 先读入校验和表，之后读入的 FAT 等块都要校验
+    char buffer[kBlockSize];
+    for (int i = 0; i != kNumOfChecksumBlocks; ++i)
+    {
+        if (!m_scheduler.read(buffer, kChecksumBlockNumber + i)) return false;
+        for (int k = 0; k != kChecksumsPerBlock; ++k) // 小端
+        {
+            auto p = reinterpret_cast<unsigned char*>(buffer + kChecksumSize * k);
+            std::uint32_t checksum = 0;
+            for (int b = 0; b != kChecksumSize; ++b)
+            {
+                checksum |= static_cast<std::uint32_t>(p[b]) << (8 * b);
+            }
+            m_checksums[kChecksumsPerBlock * i + k] = checksum;
+        }
+    }
+
+    // 重放上次没有完成检查点的日志记录，之后读入的都是最新的元数据
+    if (!replayJournal()) return false;
+
+    for (int i = 0; i != kNumOfFatBlocks; ++i)
+    {
+        if (!readBlock(m_fat + Disk::kSectorSize * i, i)) return false;
+        if (!readBlock(m_blockIndex + Disk::kSectorSize * i, kIndexBlockNumber + i)) return false;
+        if (!readBlock(m_refCount + Disk::kSectorSize * i, kRefCountBlockNumber + i)) return false;
+    }
+    std::copy(m_fat, m_fat + kFatSize, m_committedTables);
+    std::copy(m_blockIndex, m_blockIndex + kFatSize, m_committedTables + kFatSize);
+    std::copy(m_refCount, m_refCount + kFatSize, m_committedTables + kFatSize * 2);
+    m_tablesCommitted = true;
+    return true;
+}
+
+bool FileSystem::saveFat()
+{
+    return commitMetadata({}, true);
+}
+
+bool FileSystem::commitMetadata(std::vector<MetadataBlock> blocks, bool withTables)
+{
+    if (inTransaction()) // 事务中只记下目录块，提交事务时与各表一起作为一条记录提交
+    {
+        for (const auto& b : blocks)
+        {
+            m_transactionBlocks[b.block].assign(b.data, b.data + kBlockSize);
+        }
+        return true;
+    }
+
+    // 只提交表中与上次提交时不同的块
+    int numOfDirBlocks = static_cast<int>(blocks.size());
+    if (withTables)
+    {
+        const char* tables[] = {m_fat, m_blockIndex, m_refCount};
+        const int homes[] = {0, kIndexBlockNumber, kRefCountBlockNumber};
+        for (int t = 0; t != 3; ++t)
+        {
+            for (int i = 0; i != kNumOfFatBlocks; ++i)
+            {
+                const char* data = tables[t] + kBlockSize * i;
+                const char* committed = m_committedTables + kFatSize * t + kBlockSize * i;
+                if (m_tablesCommitted && std::equal(data, data + kBlockSize, committed)) continue;
+                blocks.push_back({homes[t] + i, data});
+            }
+        }
+    }
+    int n = static_cast<int>(blocks.size());
+    if (n == 0) return true;
+    if (n > kMaxJournalRecordBlocks) return false; // 只有事务会修改这么多块，一条记录放不下
+
+    // 记录头和各块的内容拼成一条连续的记录
+    char record[(kMaxJournalRecordBlocks + 1) * kBlockSize];
+    std::fill(record, record + kBlockSize, 0);
+    setUint32ToPointer(record, kJournalMagic);
+    record[kJournalCountIndex] = static_cast<char>(n);
+    for (int k = 0; k != n; ++k)
+    {
+        record[kJournalHomeIndex + k] = static_cast<char>(blocks[k].block);
+        std::copy(blocks[k].data, blocks[k].data + kBlockSize, record + kBlockSize * (k + 1));
+    }
+
+    bool needCheckpoint = false;
+    {
+        std::unique_lock<std::mutex> journalLock(m_mutex2Journal);
+        if (m_journalHead + 1 + n > kFatSize && !checkpoint(journalLock)) return false; // 日志已满
+
+        // 在锁内写入，日志记录按序号顺序落盘，记录之间没有空隙
+        setUint32ToPointer(record + kJournalSeqIndex, m_journalSeq);
+        std::uint32_t crc = toyfs::crc32c(record, kJournalCrcIndex);
+        crc ^= toyfs::crc32c(record + kBlockSize, kBlockSize * n);
+        setUint32ToPointer(record + kJournalCrcIndex, crc);
+        if (!m_disk.write(record, m_journalHead, n + 1)) return false; // 一次顺序写入，不经过调度器
+
+        ++m_journalSeq;
+        m_journalHead += n + 1;
+        ++m_journalInFlight;
+        for (int k = 0; k != numOfDirBlocks; ++k)
+        {
+            m_journalPinned[blocks[k].block] = true;
+        }
+        ++m_journalStats.records;
+        m_journalStats.blocks += n;
+        if (!m_checkpointScheduled && m_journalHead - kJournalBlockNumber > kNumOfJournalBlocks / 2)
+        {
+            m_checkpointScheduled = needCheckpoint = true; // 日志用过一半，安排后台检查点
+        }
+    }
+
+    // 提交点：日志记录持久化之后再写回原位置，写回的块由之后的 sync 或检查点持久化
+    bool succeeded = sync();
+    for (int k = 0; succeeded && k != n; ++k)
+    {
+        succeeded = writeBlock(blocks[k].data, blocks[k].block);
+    }
+    if (succeeded && withTables)
+    {
+        std::copy(m_fat, m_fat + kFatSize, m_committedTables);
+        std::copy(m_blockIndex, m_blockIndex + kFatSize, m_committedTables + kFatSize);
+        std::copy(m_refCount, m_refCount + kFatSize, m_committedTables + kFatSize * 2);
+        m_tablesCommitted = true;
+    }
+
+    {
+        std::lock_guard<std::mutex> journalLock(m_mutex2Journal);
+        --m_journalInFlight;
+    }
+    m_journalCond.notify_all();
+    if (needCheckpoint)
+    {
+        m_executor->submit([this]() {
+            TraceScope internalCall; // 后台检查点不是公开接口的调用
+            checkpoint();
+        });
+    }
+
+    return succeeded;
+}
+
+bool FileSystem::checkpoint()
+{
+    TraceScope trace(*this, toyfs::TraceOp::Checkpoint, -1);
+    std::unique_lock<std::mutex> journalLock(m_mutex2Journal);
+    m_checkpointScheduled = false;
+    return checkpoint(journalLock);
+}
+
+bool FileSystem::checkpoint(std::unique_lock<std::mutex>& journalLock)
+{
+    // 等待已经提交的记录都写回原位置，持久化之后日志中的记录就不再需要了
+    m_journalCond.wait(journalLock, [this]() { return m_journalInFlight == 0; });
+    if (m_journalHead == kJournalBlockNumber + 1) return true; // 日志是空的
+    // 事务中分配块时也可能到这里，不能像 sync 那样跳过刷新，否则原位置的写入还没有持久化就清空了日志
+    if (!flush()) return false;
+    if (!writeJournalSuperblock()) return false;
+    if (!flush()) return false;
+
+    m_journalHead = kJournalBlockNumber + 1;
+    std::fill(m_journalPinned.begin(), m_journalPinned.end(), false);
+    ++m_journalStats.checkpoints;
+    return true;
+}
+
+bool FileSystem::writeJournalSuperblock()
+{
+    char superblock[kBlockSize];
+    std::fill(superblock, superblock + kBlockSize, 0);
+    setUint32ToPointer(superblock, kJournalMagic);
+    setUint32ToPointer(superblock + kJournalSeqIndex, m_journalSeq); // 之前的记录都已失效
+    return m_disk.write(superblock, kJournalBlockNumber);
+}
+
+bool FileSystem::replayJournal()
+{
+    std::lock_guard<std::mutex> journalLock(m_mutex2Journal);
+    m_journalHead = kJournalBlockNumber + 1;
+
+    char record[(kMaxJournalRecordBlocks + 1) * kBlockSize];
+    if (!m_disk.read(record, kJournalBlockNumber)) return false;
+    if (getUint32FromPointer(record) != kJournalMagic) return true; // 还没有日志
+    m_journalSeq = getUint32FromPointer(record + kJournalSeqIndex);
+
+    // 依次重放序号连续并且完整的记录，遇到第一条不完整的记录（崩溃时正在写入）为止
+    long replayed = 0;
+    for (int pos = kJournalBlockNumber + 1; pos < kFatSize;)
+    {
+        if (!m_disk.read(record, pos)) return false;
+        if (getUint32FromPointer(record) != kJournalMagic) break;
+        if (getUint32FromPointer(record + kJournalSeqIndex) != m_journalSeq) break; // 上一轮日志的旧记录
+        int n = static_cast<unsigned char>(record[kJournalCountIndex]);
+        if (n == 0 || n > kMaxJournalRecordBlocks || pos + 1 + n > kFatSize) break;
+        if (!m_disk.read(record + kBlockSize, pos + 1, n)) return false;
+        std::uint32_t crc = toyfs::crc32c(record, kJournalCrcIndex);
+        crc ^= toyfs::crc32c(record + kBlockSize, kBlockSize * n);
+        if (getUint32FromPointer(record + kJournalCrcIndex) != crc) break;
+
+        for (int k = 0; k != n; ++k)
+        {
+            int home = static_cast<unsigned char>(record[kJournalHomeIndex + k]);
+            if (!writeBlock(record + kBlockSize * (k + 1), home)) return false;
+        }
+        ++m_journalSeq;
+        ++replayed;
+        pos += n + 1;
+    }
+    if (replayed == 0) return true;
+
+    // 重放的块持久化之后清空日志
+    m_journalStats.replayed += replayed;
+    if (!sync()) return false;
+    if (!writeJournalSuperblock()) return false;
+    return sync();
+}
+
+FileSystem::JournalStats FileSystem::journalStats()
+{
+    std::lock_guard<std::mutex> journalLock(m_mutex2Journal);
+    return m_journalStats;
+}
+
+bool FileSystem::readBlock(char* buf, int block)
+{
+    if (inTransaction()) // 事务中修改过的目录块还没有写入磁盘
+    {
+        auto iter = m_transactionBlocks.find(block);
+        if (iter != m_transactionBlocks.end())
+        {
+            std::copy(iter->second.begin(), iter->second.end(), buf);
+            return true;
+        }
+    }
+    // 同一个块的读写已由目录锁、文件锁或 FAT 锁串行化，这里不再加锁
+    if (!m_scheduler.read(buf, block)) return false;
+    std::uint32_t expected = m_checksums[block];
+    if (!m_verifyChecksums || expected == 0) return true; // 不校验，或者没有记录校验和
+
+    bool match = toyfs::crc32c(buf, kBlockSize) == expected;
+    ++m_checksumsVerified;
+    if (!match) ++m_checksumFailures; // 由 checksumStats 报告
+    return match;
+}
+
+bool FileSystem::writeBlock(const char* buf, int block)
+{
+    if (inTransaction()) m_transactionBlocks.erase(block); // 事务中删除的目录的块被重新分配为数据块
+    std::uint32_t checksum = toyfs::crc32c(buf, kBlockSize);
+    if (!m_scheduler.write(buf, block)) return false;
+    m_checksums[block] = checksum;
+    m_checksumDirty[block / kChecksumsPerBlock] = true;
+    return true;
+}
+
+bool FileSystem::flushChecksums()
+{
+    std::lock_guard<std::mutex> checksumLock(m_mutex4Checksum); // 串行化写回
+    char buffer[kBlockSize];
+    for (int i = 0; i != kNumOfChecksumBlocks; ++i)
+    {
+        if (!m_checksumDirty[i].exchange(false)) continue; // 先清除标记，写回期间的修改会在下次写回
+        for (int k = 0; k != kChecksumsPerBlock; ++k) // 小端
+        {
+            std::uint32_t checksum = m_checksums[kChecksumsPerBlock * i + k];
+            for (int b = 0; b != kChecksumSize; ++b)
+            {
+                buffer[kChecksumSize * k + b] = static_cast<char>((checksum >> (8 * b)) & 0xff);
+            }
+        }
+        if (!m_scheduler.write(buffer, kChecksumBlockNumber + i))
+        {
+            m_checksumDirty[i] = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+int FileSystem::nextAvailableBlock()
+{
+    // 日志中有记录的目录块释放后暂不分配，否则崩溃后重放日志时旧的目录内容会覆盖新数据
+    bool pinned = false;
+    {
+        std::lock_guard<std::mutex> journalLock(m_mutex2Journal);
+        for (int i = 0; i != kFatSize; ++i)
+        {
+            if (m_fat[i] != 0 || m_transactionFreed[i]) continue;
+            if (!m_journalPinned[i]) return i;
+            pinned = true;
+        }
+    }
+    if (!pinned || !checkpoint()) return -1;
+
+    // 检查点之后不再有被日志占用的块
+    for (int i = 0; i != kFatSize; ++i)
+    {
+        if (m_fat[i] == 0 && !m_transactionFreed[i])
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+std::shared_ptr<FileSystem::OpenedFile> FileSystem::getOpenedFile(int fd)
+{
+    if (fd < 0) return nullptr;
+    FdShard& shard = m_fdShards[fd % kNumOfFdShards];
+    int slot = fd / kNumOfFdShards;
+
+    std::lock_guard<std::mutex> shardLock(shard.mutex);
+    if (slot >= static_cast<int>(shard.slots.size())) return nullptr;
+    return shard.slots[slot]; // 返回的是共享指针，即使描述符随后被关闭也能安全使用
+}
+
+FileSystem::FdShard& FileSystem::fdShardOf(const std::string& fullPath)
+{
+    return m_fdShards[std::hash<std::string>()(fullPath) % kNumOfFdShards];
+}
+
+int FileSystem::seekBlock(int firstBlock, ChainPosition& pos, int index)
+{
+    int next;
+    if (pos.block < 0 || index < pos.index) // 当前位置在目标之后，只能从头开始找
+    {
+        pos = {-1, -1};
+        next = firstBlock;
+    }
+    else
+    {
+        next = m_fat[pos.block];
+    }
+    for (; next >= 0 && blockIndex(next) <= index; next = m_fat[next])
+    {
+        pos = {blockIndex(next), next};
+    }
+    return pos.index == index ? pos.block : -1;
+}
+
+int FileSystem::insertBlock(int& firstBlock, ChainPosition& pos, int index)
+{
+    int newBlock = nextAvailableBlock();
+    if (newBlock == -1) return -1; // 没有新块可供分配
+
+    if (pos.block < 0) // 插在链头
+    {
+        m_fat[newBlock] = firstBlock;
+        firstBlock = newBlock;
+    }
+    else
+    {
+        m_fat[newBlock] = m_fat[pos.block];
+        m_fat[pos.block] = newBlock;
+    }
+    m_blockIndex[newBlock] = static_cast<char>(index);
+    m_refCount[newBlock] = 1;
+    pos = {index, newBlock};
+
+    return newBlock;
+}
+
+int FileSystem::unshareChain(int& firstBlock, int lastIndex)
+{
+    // 找到范围内第一个被共享的块
+    int previous = -1; // -1 表示目录项
+    int block = firstBlock;
+    while (block >= 0 && blockIndex(block) <= lastIndex && references(block) == 1)
+    {
+        previous = block;
+        block = m_fat[block];
+    }
+    if (block < 0 || blockIndex(block) > lastIndex) return 0; // 范围内没有共享的块
+
+    // 先确认有足够的块可供分配，避免复制到一半失败
+    int numOfCopies = 0;
+    int rest = block; // 复制之后仍然共享的部分
+    for (; rest >= 0 && blockIndex(rest) <= lastIndex; rest = m_fat[rest])
+    {
+        ++numOfCopies;
+    }
+    if (numOfCopies > numOfAvailableBlocks()) return -1;
+    if (rest >= 0 && m_refCount[rest] >= kMaxRefCount) return -1; // 副本还要指向它，引用计数已满
+
+    --m_refCount[block]; // previous 不再指向它
+    char scratch[kBlockSize];
+    while (block >= 0 && blockIndex(block) <= lastIndex)
+    {
+        int newBlock = nextAvailableBlock();
+        if (!readBlock(scratch, block) || !writeBlock(scratch, newBlock)) return -1;
+        m_fat[newBlock] = -1;
+        m_blockIndex[newBlock] = m_blockIndex[block];
+        m_refCount[newBlock] = 1;
+        if (previous < 0)
+        {
+            firstBlock = newBlock;
+        }
+        else
+        {
+            m_fat[previous] = newBlock;
+        }
+        previous = newBlock;
+        block = m_fat[block];
+    }
+
+    // 链接回剩余的共享部分
+    m_fat[previous] = block;
+    if (block >= 0) ++m_refCount[block];
+
+    return numOfCopies;
+}
+
+void FileSystem::releaseChain(int firstBlock)
+{
+    int blockNumber = firstBlock;
+    while (blockNumber >= 0)
+    {
+        --m_refCount[blockNumber];
+        if (references(blockNumber) > 0) break; // 还被共享，之后的块也都还有引用
+        int next = m_fat[blockNumber];
+        m_fat[blockNumber] = 0;
+        m_blockIndex[blockNumber] = 0;
+        if (inTransaction()) m_transactionFreed[blockNumber] = true; // 撤销时恢复的各表仍指向它，事务结束前不能分配
+        dropCachedUnit(blockNumber);
+        blockNumber = next;
+    }
+}
+
+void FileSystem::unpinChain(int firstBlock)
+{
+    if (--m_snapshotPins[firstBlock] > 0 || m_refCount[firstBlock] > 0) return; // 还有其他引用
+    int next = m_fat[firstBlock];
+    m_fat[firstBlock] = 0;
+    m_blockIndex[firstBlock] = 0;
+    dropCachedUnit(firstBlock);
+    releaseChain(next); // 链头指向下一块的引用
+}
+
+bool FileSystem::reclaimOrphanedChains()
+{
+    std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
+    bool reclaimed = false;
+    for (int block = kRootBlockNumber + 1; block != kJournalBlockNumber; ++block)
+    {
+        if (m_fat[block] == 0 || m_fat[block] == -2 || m_refCount[block] != 0) continue; // 空闲、坏块或有引用
+        int next = m_fat[block];
+        m_fat[block] = 0;
+        m_blockIndex[block] = 0;
+        releaseChain(next);
+        reclaimed = true;
+    }
+    return !reclaimed || saveFat();
+}
+
+int FileSystem::numOfAvailableBlocks()
+{
+    int n = 0;
+    for (int i = 0; i != kFatSize; ++i)
+    {
+        if (m_fat[i] == 0 && !m_transactionFreed[i]) ++n;
+    }
+    return n;
+}
+
+int FileSystem::readData(Attributes attributes, int firstBlock, int size, ChainPosition& pos, int offset,
+                         const IoVec* iov, int iovcnt)
+{
+    if (attributes & Compressed) return readCompressed(firstBlock, size, pos, offset, iov, iovcnt);
+
+    int length = std::min(totalLength(iov, iovcnt), size - offset); // 不超过文件尾
+    if (length <= 0) return 0;
+
+    // 先在 FAT 锁内找出要读取的所有块，随后的磁盘读取不再持有文件系统的任何锁
+    int firstIndex = offset / kBlockSize;
+    int lastIndex = (offset + length - 1) / kBlockSize;
+    std::vector<int> blocks; // 空洞为 -1
+    blocks.reserve(lastIndex - firstIndex + 1);
+    {
+        std::shared_lock<std::shared_mutex> fatLock(m_mutex1Fat);
+        for (int index = firstIndex; index <= lastIndex; ++index)
+        {
+            blocks.push_back(seekBlock(firstBlock, pos, index));
+        }
+    }
+
+    // 完整的块直接读入调用者的数据段，首尾不完整或跨数据段的块经过 scratch 中转
+    static const char zeros[kBlockSize] = {};
+    char scratch[kBlockSize];
+    int wp = 0; // write pointer on buffer
+
+    for (int block : blocks)
+    {
+        int rp = (offset + wp) % kBlockSize;            // 当前读取的块内指针
+        int n = std::min(length - wp, kBlockSize - rp); // 本块内要读取的字节数
+        char* direct = n == kBlockSize ? contiguousSegment(iov, iovcnt, wp, n) : nullptr;
+        if (block < 0) // 空洞，不需要读磁盘
+        {
+            scatterSegments(iov, iovcnt, wp, zeros + rp, n);
+        }
+        else if (direct != nullptr)
+        {
+            if (!readBlock(direct, block)) break;
+        }
+        else
+        {
+            if (!readBlock(scratch, block)) break;
+            scatterSegments(iov, iovcnt, wp, scratch + rp, n);
+        }
+        wp += n;
+    }
+
+    return wp;
+}
+
+int FileSystem::writeData(OpenedFile& of, int offset, const IoVec* iov, int iovcnt)
+{
+    // 没有块的文件写入后仍然足够小时内嵌在目录项中
+    bool noBlocks = of.inlined || (of.blockNumber < 0 && of.size == 0);
+    if (noBlocks && offset + totalLength(iov, iovcnt) <= kMaxInlineSize) return writeInline(of, offset, iov, iovcnt);
+    if (of.attributes & Compressed) return writeCompressed(of, offset, iov, iovcnt);
+
+    static const char zeros[kBlockSize] = {};
+
+    int length = totalLength(iov, iovcnt);
+    if (offset + length > kMaxFileSize) return 0; // 超出文件大小上限
+
+    // 写到文件尾之后时，原有块中文件尾之后的部分要填零，其余的空隙成为空洞
+    int start = std::min(offset, of.size);
+    int end = offset + length;
+    if (start >= end) return 0;
+
+    // 在 FAT 锁内一次性找出所有要写入的块，不够时一次性分配新块，写入数据之后与目录项一起只提交一次
+    int firstIndex = start / kBlockSize;
+    int lastIndex = (end - 1) / kBlockSize;
+    int oldFirstBlock = of.blockNumber;
+    bool migrating = of.inlined; // 内嵌的数据迁移到第 0 块中
+    std::vector<int> blocks;    // 空洞为 -1
+    std::vector<char> newBlock; // 是否为新分配的块
+    blocks.reserve(lastIndex - firstIndex + 1);
+    newBlock.reserve(lastIndex - firstIndex + 1);
+    bool fatChanged;
+    {
+        std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
+
+        // 要修改的块如果被其他文件共享，先复制一份
+        int numOfCopies = unshareChain(of.blockNumber, lastIndex);
+        if (numOfCopies < 0) return 0;
+        fatChanged = numOfCopies > 0;
+        if (fatChanged) of.cached = {-1, -1}; // 缓存的位置可能已经不在块链上
+
+        for (int index = firstIndex; index <= lastIndex; ++index)
+        {
+            int block = seekBlock(of.blockNumber, of.cached, index);
+            bool isNew = false;
+            if (block < 0)
+            {
+                bool keepsInlineData = migrating && index == 0;
+                if (!keepsInlineData && std::min(end, (index + 1) * kBlockSize) <= offset) // 整块都在空隙中，保留为空洞
+                {
+                    blocks.push_back(-1);
+                    newBlock.push_back(false);
+                    continue;
+                }
+                block = insertBlock(of.blockNumber, of.cached, index);
+                if (block < 0) break; // 没有新块可供分配，能写多少写多少
+                ++of.numOfBlocks;
+                isNew = true;
+                fatChanged = true;
+            }
+            blocks.push_back(block);
+            newBlock.push_back(isNew);
+        }
+    }
+
+    char scratch[kBlockSize]; // 不完整的块在这里拼好后再写入
+    int pos = start;
+
+    for (size_t i = 0; i != blocks.size(); ++i)
+    {
+        int index = firstIndex + static_cast<int>(i);
+        int blockPos = index * kBlockSize;              // 块在文件中的起始位置
+        int to = std::min(end, blockPos + kBlockSize); // 本块内写入范围为 [pos, to)
+        int dataFrom = std::max(pos, offset);          // [pos, dataFrom) 是空隙
+        bool wholeBlock = pos == blockPos && to == blockPos + kBlockSize;
+        if (blocks[i] < 0) // 空洞，不需要写入
+        {
+            pos = to;
+            continue;
+        }
+
+        const char* direct = (wholeBlock && dataFrom == pos) ? contiguousSegment(iov, iovcnt, pos - offset, kBlockSize)
+                                                              : nullptr;
+        if (direct != nullptr) // 整块覆盖，直接从调用者的缓冲区写入
+        {
+            if (!writeBlock(direct, blocks[i])) break;
+        }
+        else if (wholeBlock && to <= offset) // 整块都是空隙
+        {
+            if (!writeBlock(zeros, blocks[i])) break;
+        }
+        else
+        {
+            // 只有原有的块中、本次写入范围之外还有文件数据时才需要先读出
+            int dataEnd = std::min(of.size, blockPos + kBlockSize);
+            bool keepOldData = !wholeBlock && !newBlock[i] && (pos > blockPos || to < dataEnd);
+            if (keepOldData)
+            {
+                if (!readBlock(scratch, blocks[i])) break;
+            }
+            else
+            {
+                std::fill(scratch, scratch + kBlockSize, 0);
+            }
+            if (migrating && index == 0)
+            {
+                std::copy(of.inlineData, of.inlineData + of.size, scratch);
+            }
+            if (dataFrom > pos) // 空隙填零
+            {
+                std::fill(scratch + (pos - blockPos), scratch + (std::min(to, dataFrom) - blockPos), 0);
+            }
+            if (dataFrom < to)
+            {
+                gatherSegments(iov, iovcnt, dataFrom - offset, scratch + (dataFrom - blockPos), to - dataFrom);
+            }
+            if (!writeBlock(scratch, blocks[i])) break;
+        }
+        pos = to;
+    }
+
+    if (migrating && pos > start) of.inlined = false; // 第 0 块已经写入
+
+    // 数据写入之后，父目录项和修改过的各表作为一条日志记录提交，每次调用只提交一次
+    bool entryChanged = !of.inlined && (pos > of.size || of.blockNumber != oldFirstBlock);
+    if (entryChanged) of.size = std::max(of.size, pos);
+    if ((entryChanged || fatChanged) && !saveEntry(of, fatChanged)) return 0;
+
+    return std::max(0, pos - offset);
+}
+
+int FileSystem::readInline(const char* data, int size, int offset, const IoVec* iov, int iovcnt)
+{
+    int length = std::min(totalLength(iov, iovcnt), size - offset); // 不超过文件尾
+    if (length <= 0) return 0;
+    scatterSegments(iov, iovcnt, 0, data + offset, length);
+    return length;
+}
+
+int FileSystem::writeInline(OpenedFile& of, int offset, const IoVec* iov, int iovcnt)
+{
+    int length = totalLength(iov, iovcnt);
+    int end = offset + length;
+    if (std::min(offset, of.size) >= end) return 0;
+
+    if (offset > of.size) // 空隙填零
+    {
+        std::fill(of.inlineData + of.size, of.inlineData + offset, 0);
+    }
+    gatherSegments(iov, iovcnt, 0, of.inlineData + offset, length);
+    of.size = std::max(of.size, end);
+    of.inlined = true;
+
+    // 数据和大小都在目录项中，只需要读写一次目录块
+    if (!saveEntry(of, false)) return 0;
+
+    return length;
+}
+
+bool FileSystem::saveEntry(const OpenedFile& of, bool withTables)
+{
+    std::lock_guard<std::shared_mutex> dirLock(m_dirLocks[of.parentBlock]);
+    std::unique_lock<std::shared_mutex> fatLock(m_mutex1Fat, std::defer_lock);
+    if (withTables) fatLock.lock(); // 按目录、FAT 的顺序加锁
+    char buffer[kBlockSize];
+    if (!readBlock(buffer, of.parentBlock)) return false;
+    char* fileEntryPointer = buffer + kEntrySize * of.entryIndex;
+    if (of.inlined)
+    {
+        setInlineDataToEntryPointer(fileEntryPointer, of.attributes, of.inlineData, of.size);
+    }
+    else
+    {
+        fileEntryPointer[kEntryAttributesIndex] = of.attributes; // 清除内嵌标志
+        fileEntryPointer[kEntryBlockStartIndex] = of.blockNumber;
+        setSizeToEntryPointer(fileEntryPointer, of.size);
+    }
+    return commitMetadata({{of.parentBlock, buffer}}, withTables);
+}
+
+int FileSystem::readCompressed(int firstBlock, int size, ChainPosition& pos, int offset, const IoVec* iov,
+                               int iovcnt)
+{
+    int length = std::min(totalLength(iov, iovcnt), size - offset); // 不超过文件尾
+    if (length <= 0) return 0;
+
+    // 逐个压缩单元解压后复制到调用者的数据段
+    char unit[kCompressionUnitSize];
+    int wp = 0; // write pointer on buffer
+    while (wp < length)
+    {
+        int rp = (offset + wp) % kCompressionUnitSize;            // 当前读取的单元内指针
+        int n = std::min(length - wp, kCompressionUnitSize - rp); // 本单元内要读取的字节数
+        if (!loadUnit(firstBlock, pos, (offset + wp) / kCompressionUnitSize, unit)) break;
+        scatterSegments(iov, iovcnt, wp, unit + rp, n);
+        wp += n;
+    }
+
+    return wp;
+}
+
+int FileSystem::writeCompressed(OpenedFile& of, int offset, const IoVec* iov, int iovcnt)
+{
+    int length = totalLength(iov, iovcnt);
+    if (offset + length > kMaxFileSize) return 0; // 超出文件大小上限
+
+    // 与 writeData 相同，原有数据之后到 offset 的空隙填零，整个单元都在空隙中的保留为空洞
+    int start = std::min(offset, of.size);
+    int end = offset + length;
+    if (start >= end) return 0;
+
+    int oldFirstBlock = of.blockNumber;
+    bool migrating = of.inlined; // 内嵌的数据迁移到第 0 个单元中
+    bool fatChanged = false;
+    char unit[kCompressionUnitSize];
+    int pos = start;
+
+    while (pos < end)
+    {
+        int u = pos / kCompressionUnitSize;
+        int unitPos = u * kCompressionUnitSize;                 // 单元在文件中的起始位置
+        int to = std::min(end, unitPos + kCompressionUnitSize); // 本单元内写入范围为 [pos, to)
+        int dataFrom = std::max(pos, offset);                   // [pos, dataFrom) 是空隙
+        if (pos == unitPos && to <= offset)                     // 整个单元都在空隙中
+        {
+            pos = to;
+            continue;
+        }
+
+        // 每次写入都要重新压缩整个单元，所以总是先读出原有数据
+        ChainPosition chainPos = {-1, -1};
+        if (!loadUnit(of.blockNumber, chainPos, u, unit)) break;
+        if (migrating && u == 0)
+        {
+            std::copy(of.inlineData, of.inlineData + of.size, unit);
+        }
+        if (dataFrom > pos) // 空隙填零
+        {
+            std::fill(unit + (pos - unitPos), unit + (std::min(to, dataFrom) - unitPos), 0);
+        }
+        if (dataFrom < to)
+        {
+            gatherSegments(iov, iovcnt, dataFrom - offset, unit + (dataFrom - unitPos), to - dataFrom);
+        }
+        int unitLength = std::max(std::min(of.size, unitPos + kCompressionUnitSize), to) - unitPos;
+        if (!storeUnit(of, u, unit, unitLength, fatChanged)) break;
+        pos = to;
+    }
+
+    if (migrating && pos > start) of.inlined = false; // 第 0 块已经写入
+
+    // 数据写入之后，父目录项和修改过的各表作为一条日志记录提交，每次调用只提交一次
+    bool entryChanged = !of.inlined && (pos > of.size || of.blockNumber != oldFirstBlock);
+    if (entryChanged) of.size = std::max(of.size, pos);
+    if ((entryChanged || fatChanged) && !saveEntry(of, fatChanged)) return 0;
+
+    return std::max(0, pos - offset);
+}
+
+bool FileSystem::loadUnit(int firstBlock, ChainPosition& pos, int unit, char* data)
+{
+    // 单元的块从逻辑块号 unit * kCompressionUnitBlocks 开始连续排列
+    int blocks[kCompressionUnitBlocks];
+    int numOfBlocks = 0;
+    {
+        std::shared_lock<std::shared_mutex> fatLock(m_mutex1Fat);
+        for (; numOfBlocks != kCompressionUnitBlocks; ++numOfBlocks)
+        {
+            int block = seekBlock(firstBlock, pos, unit * kCompressionUnitBlocks + numOfBlocks);
+            if (block < 0) break;
+            blocks[numOfBlocks] = block;
+        }
+    }
+
+    if (numOfBlocks == 0) // 空洞
+    {
+        std::fill(data, data + kCompressionUnitSize, 0);
+        return true;
+    }
+    if (findCachedUnit(blocks[0], data)) return true;
+
+    char payload[kCompressionUnitSize];
+    for (int i = 0; i != numOfBlocks; ++i)
+    {
+        if (!readBlock(payload + kBlockSize * i, blocks[i])) return false;
+    }
+    if (numOfBlocks == kCompressionUnitBlocks) // 按原样存储
+    {
+        std::copy(payload, payload + kCompressionUnitSize, data);
+    }
+    else
+    {
+        int compressedSize = static_cast<unsigned char>(payload[0]);
+        if (compressedSize >= numOfBlocks * kBlockSize) return false; // 数据已损坏
+        int n = toyfs::lz::decompress(payload + 1, compressedSize, data, kCompressionUnitSize);
+        if (n < 0) return false; // 数据已损坏
+        std::fill(data + n, data + kCompressionUnitSize, 0);
+    }
+    cacheUnit(blocks[0], data);
+
+    return true;
+}
+
+bool FileSystem::storeUnit(OpenedFile& of, int unit, const char* data, int length, bool& fatChanged)
+{
+    // 压缩后省不下块时按原样存储
+    char payload[kCompressionUnitSize];
+    int compressedSize = toyfs::lz::compress(data, length, payload + 1, kMaxCompressedSize);
+    int numOfBlocks = kCompressionUnitBlocks;
+    if (compressedSize >= 0)
+    {
+        payload[0] = static_cast<char>(compressedSize);
+        numOfBlocks = (compressedSize + 1 + kBlockSize - 1) / kBlockSize;
+    }
+    else
+    {
+        std::copy(data, data + kCompressionUnitSize, payload);
+    }
+
+    // 在 FAT 锁内按需要的块数增减单元占用的块
+    int firstIndex = unit * kCompressionUnitBlocks;
+    int blocks[kCompressionUnitBlocks];
+    {
+        std::lock_guard<std::shared_mutex> fatLock(m_mutex1Fat);
+
+        // 要修改的块如果被其他文件共享，先复制一份
+        int numOfCopies = unshareChain(of.blockNumber, firstIndex + kCompressionUnitBlocks - 1);
+        if (numOfCopies < 0) return false;
+        if (numOfCopies > 0) fatChanged = true;
+
+        ChainPosition pos = {-1, -1};
+        seekBlock(of.blockNumber, pos, firstIndex - 1); // 移到单元之前
+        ChainPosition unitStart = pos;
+        int numOfOldBlocks = 0;
+        while (numOfOldBlocks != kCompressionUnitBlocks &&
+               seekBlock(of.blockNumber, pos, firstIndex + numOfOldBlocks) >= 0)
+        {
+            ++numOfOldBlocks;
+        }
+        bool copyOnWrite = inTransaction() && numOfOldBlocks > 0; // 撤销事务时原有的块还要用
+        if (numOfBlocks - (copyOnWrite ? 0 : numOfOldBlocks) > numOfAvailableBlocks())
+        {
+            return false; // 没有足够的块可供分配
+        }
+
+        pos = unitStart;
+        for (int i = 0; i != kCompressionUnitBlocks; ++i)
+        {
+            int index = firstIndex + i;
+            int next = pos.block < 0 ? of.blockNumber : m_fat[pos.block];
+            bool present = next >= 0 && blockIndex(next) == index;
+            if (present && (copyOnWrite || i >= numOfBlocks)) // 多余的块以及事务中要换成新块的块从链上摘下并回收
+            {
+                if (pos.block < 0)
+                {
+                    of.blockNumber = m_fat[next];
+                }
+                else
+                {
+                    m_fat[pos.block] = m_fat[next];
+                }
+                m_fat[next] = 0;
+                m_blockIndex[next] = 0;
+                m_refCount[next] = 0;
+                if (copyOnWrite) m_transactionFreed[next] = true; // 撤销时恢复的各表仍指向它，事务结束前不能分配
+                dropCachedUnit(next);
+                --of.numOfBlocks;
+                fatChanged = true;
+                present = false;
+            }
+            if (i < numOfBlocks)
+            {
+                if (present)
+                {
+                    pos = {index, next};
+                }
+                else
+                {
+                    insertBlock(of.blockNumber, pos, index);
+                    ++of.numOfBlocks;
+                    fatChanged = true;
+                }
+                blocks[i] = pos.block;
+            }
+        }
+        if (fatChanged) of.cached = {-1, -1}; // 缓存的位置可能已经不在块链上
+    }
+
+    for (int i = 0; i != numOfBlocks; ++i)
+    {
+        if (!writeBlock(payload + kBlockSize * i, blocks[i])) return false;
+    }
+    // 解压缓存中保存完整的单元，有效数据之后为零
+    char cached[kCompressionUnitSize] = {};
+    std::copy(data, data + length, cached);
+    cacheUnit(blocks[0], cached);
+
+    return true;
+}
+
+bool FileSystem::findCachedUnit(int block, char* data)
+{
+    std::lock_guard<std::mutex> cacheLock(m_mutex3Cache);
+    auto iter = m_unitCacheIndex.find(block);
+    if (iter == m_unitCacheIndex.end())
+    {
+        ++m_cacheStats.misses;
+        return false;
+    }
+    ++m_cacheStats.hits;
+    m_unitCache.splice(m_unitCache.begin(), m_unitCache, iter->second); // 移到最前
+    std::copy(iter->second->data, iter->second->data + kCompressionUnitSize, data);
+    return true;
+}
+
+void FileSystem::cacheUnit(int block, const char* data)
+{
+    std::lock_guard<std::mutex> cacheLock(m_mutex3Cache);
+    auto iter = m_unitCacheIndex.find(block);
+    if (iter != m_unitCacheIndex.end())
+    {
+        m_unitCache.splice(m_unitCache.begin(), m_unitCache, iter->second);
+    }
+    else
+    {
+        if (m_unitCache.size() == kNumOfCachedUnits) // 淘汰最久没有使用的单元
+        {
+            m_unitCacheIndex.erase(m_unitCache.back().block);
+            m_unitCache.pop_back();
+        }
+        m_unitCache.emplace_front();
+        m_unitCache.front().block = block;
+        m_unitCacheIndex[block] = m_unitCache.begin();
+    }
+    std::copy(data, data + kCompressionUnitSize, m_unitCache.front().data);
+}
+
+void FileSystem::dropCachedUnit(int block)
+{
+    std::lock_guard<std::mutex> cacheLock(m_mutex3Cache);
+    auto iter = m_unitCacheIndex.find(block);
+    if (iter == m_unitCacheIndex.end()) return;
+    m_unitCache.erase(iter->second);
+    m_unitCacheIndex.erase(iter);
+}
+
+bool FileSystem::isOpened(const std::string& fullPath)
+{
+    FdShard& shard = fdShardOf(fullPath);
+    std::lock_guard<std::mutex> shardLock(shard.mutex);
+    return shard.paths.find(fullPath) != std::end(shard.paths);
+}
+
+std::vector<std::string> FileSystem::getOpenedFiles()
+{
+    std::vector<std::string> ret;
+    for (auto& shard : m_fdShards)
+    {
+        std::lock_guard<std::mutex> shardLock(shard.mutex);
+        for (auto const& e : shard.paths)
+        {
+            ret.push_back(e.first);
+        }
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+std::string FileSystem::getNameFromEntryPointer(char* p)
+{
+    char* end = p;
+    for (; end != p + kEntryNameLength && *end != '$'; ++end)
+    {
+    }
+    return std::string(p, end);
+}
+
+void FileSystem::setNameToEntryPointer(char* p, const std::string& name)
+{
+    std::copy(name.begin(), name.end(), p);
+    if (name.length() < kEntryNameLength)
+    {
+        p[name.length()] = '$'; // 设置文件名结束标志
+    }
+}
+
+FileSystem::Attributes FileSystem::getAttributesFromEntryPointer(char* p)
+{
+    return static_cast<unsigned char>(p[kEntryAttributesIndex]) & (kInlineFlag - 1);
+}
+
+int FileSystem::getBlockStartFromEntryPointer(char* p)
+{
+    if (p[kEntryAttributesIndex] & kInlineFlag) return -1; // 内嵌文件没有块
+    return p[kEntryBlockStartIndex];
+}
+
+int FileSystem::getSizeFromEntryPointer(char* p)
+{
+    if (p[kEntryAttributesIndex] & kInlineFlag)
+    {
+        return static_cast<unsigned char>(p[kEntryAttributesIndex]) >> kInlineSizeShift;
+    }
+    auto low = static_cast<unsigned char>(p[kEntrySizeIndex]);
+    auto high = static_cast<unsigned char>(p[kEntrySizeIndex + 1]);
+    return low | (high << 8);
+}
+
+void FileSystem::setSizeToEntryPointer(char* p, int size)
+{
+    p[kEntrySizeIndex] = static_cast<char>(size & 0xff);
+    p[kEntrySizeIndex + 1] = static_cast<char>((size >> 8) & 0xff);
+}
+
+void FileSystem::setInlineDataToEntryPointer(char* p, Attributes attributes, const char* data, int size)
+{
+    p[kEntryAttributesIndex] = static_cast<char>(attributes | kInlineFlag | (size << kInlineSizeShift));
+    std::copy(data, data + size, p + kEntryInlineDataIndex);
+    std::fill(p + kEntryInlineDataIndex + size, p + kEntrySize, 0);
+}
+
+char* FileSystem::findChildEntryPointer(char* parentEntryPointer, const std::string& childName)
+{
+    for (int i = 0; i != kMaxChildEntries; ++i)
+    {
+        char* childEntryPointer = parentEntryPointer + kEntrySize * i;
+        auto name = getNameFromEntryPointer(childEntryPointer);
+        if (name == childName) // 找到对应的目录项
+        {
+            return childEntryPointer;
+        }
+    }
+    return nullptr;
+}
+
+std::uint32_t FileSystem::getUint32FromPointer(const char* p)
+{
+    auto q = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<std::uint32_t>(q[0]) | static_cast<std::uint32_t>(q[1]) << 8 |
+           static_cast<std::uint32_t>(q[2]) << 16 | static_cast<std::uint32_t>(q[3]) << 24;
+}
+
+void FileSystem::setUint32ToPointer(char* p, std::uint32_t value)
+{
+    for (int b = 0; b != 4; ++b)
+    {
+        p[b] = static_cast<char>((value >> (8 * b)) & 0xff);
+    }
+}
+
+bool FileSystem::checkName(const std::string& name)
+{
+    return name.length() > 0 && name.length() < kRawFileNameLength && name.find_first_of('$') == std::string::npos;
+}
+
+std::list<std::string> FileSystem::splitPath(const std::string& fullPath)
+{
+    std::list<std::string> names;
+    std::string name;
+    std::istringstream iss(fullPath);
+    while (getline(iss, name, '/'))
+    {
+        names.push_back(name);
+    }
+    if (names.front().length() == 0)
+    {
+        names.pop_front(); // 移除没有名字的根目录
+    }
+    return names;
+}
+
+double FileSystem::compressionRatio(const Stat& st)
+{
+    // 未压缩的文件最后一块不满或者有空洞时占用的空间也与大小不同，但那不是压缩
+    if (!(st.attributes & Compressed) || st.numOfBlocks == 0) return 1.0;
+    return static_cast<double>(st.size) / (st.numOfBlocks * kBlockSize);
+}
+
+int FileSystem::totalLength(const IoVec* iov, int iovcnt)
+{
+    int length = 0;
+    for (int i = 0; i != iovcnt; ++i)
+    {
+        length += iov[i].length;
+    }
+    return length;
+}
+
+char* FileSystem::contiguousSegment(const IoVec* iov, int iovcnt, int offset, int n)
+{
+    for (int i = 0; i != iovcnt; ++i)
+    {
+        if (offset < iov[i].length)
+        {
+            return offset + n <= iov[i].length ? iov[i].base + offset : nullptr;
+        }
+        offset -= iov[i].length;
+    }
+    return nullptr;
+}
+
+void FileSystem::gatherSegments(const IoVec* iov, int iovcnt, int offset, char* dst, int n)
+{
+    for (int i = 0; i != iovcnt && n > 0; ++i)
+    {
+        if (offset >= iov[i].length) // 还没到起始的数据段
+        {
+            offset -= iov[i].length;
+            continue;
+        }
+        int m = std::min(n, iov[i].length - offset);
+        std::copy(iov[i].base + offset, iov[i].base + offset + m, dst);
+        dst += m;
+        n -= m;
+        offset = 0;
+    }
+}
+
+void FileSystem::scatterSegments(const IoVec* iov, int iovcnt, int offset, const char* src, int n)
+{
+    for (int i = 0; i != iovcnt && n > 0; ++i)
+    {
+        if (offset >= iov[i].length) // 还没到起始的数据段
+        {
+            offset -= iov[i].length;
+            continue;
+        }
+        int m = std::min(n, iov[i].length - offset);
+        std::copy(src, src + m, iov[i].base + offset);
+        src += m;
+        n -= m;
+        offset = 0;
+    }
+}
+
+Snapshot::Snapshot(FileSystem& fs) : m_fs(fs)
+{
+    m_rootEntry = std::make_shared<Entry>(fs);
+    m_rootEntry->m_name = "/";
+    m_rootEntry->m_attributes = FileSystem::Directory | FileSystem::System;
+    m_rootEntry->m_blockStart = fs.kRootBlockNumber;
+    m_rootEntry->m_size = 0;
+    m_rootEntry->m_entryIndex = -1;
+    m_rootEntry->m_parent = m_rootEntry->self();
+    m_rootEntry->m_snapshot = this;
+}
+
+Snapshot::~Snapshot()
+{
+    // 释放对文件块链的引用，文件在快照之后被删除或改写时，只属于快照的块在这里回收
+    FileSystem::UpdateLock updateLock(m_fs);
+    std::lock_guard<std::shared_mutex> fatLock(m_fs.m_mutex1Fat);
+    for (int blockStart : m_pinnedChains)
+    {
+        m_fs.unpinChain(blockStart);
+    }
+    if (!m_pinnedChains.empty()) m_fs.saveFat(); // 只属于快照的块被回收时才有修改
+    m_rootEntry->m_parent.reset(); // 打破根目录对自身的引用
+}
+
+std::shared_ptr<Entry> Snapshot::rootEntry()
+{
+    return m_rootEntry;
+}
+
+std::shared_ptr<Entry> Snapshot::getEntry(const std::string& fullPath)
+{
+    if (fullPath[0] != '/') return nullptr; // 不是绝对路径
+
+    auto targetEntry = m_rootEntry;
+    for (const auto& name : FileSystem::splitPath(fullPath))
+    {
+        targetEntry = targetEntry->findChild(name);
+        if (targetEntry == nullptr) break;
+    }
+
+    return targetEntry;
+}
+
+bool Snapshot::exist(const std::string& fullPath)
+{
+    return getEntry(fullPath) != nullptr;
+}
+
+int Snapshot::readAt(const std::string& fullPath, int offset, char* buf_out, int length)
+{
+    auto entry = getEntry(fullPath);
+    if (entry == nullptr || entry->isDir() || offset < 0) return 0;
+    FileSystem::IoVec iov = {buf_out, length};
+    if (!entry->m_inlineData.empty())
+    {
+        return m_fs.readInline(entry->m_inlineData.data(), entry->m_size, offset, &iov, 1);
+    }
+    // 快照持有链头的引用，块链和块的内容与创建快照时相同
+    FileSystem::ChainPosition pos = {-1, -1};
+    return m_fs.readData(entry->m_attributes, entry->m_blockStart, entry->m_size, pos, offset, &iov, 1);
+}
+
+void Transaction::createDir(const std::string& fullPath)
+{
+    m_operations.push_back({Operation::CreateDir, fullPath, 0, std::string()});
+}
+
+void Transaction::createFile(const std::string& fullPath, FileSystem::Attributes attributes)
+{
+    m_operations.push_back({Operation::CreateFile, fullPath, attributes, std::string()});
+}
+
+void Transaction::writeFile(const std::string& fullPath, const char* buf_in, int length)
+{
+    m_operations.push_back({Operation::WriteFile, fullPath, 0, std::string(buf_in, std::max(length, 0))});
+}
+
+void Transaction::setFileAttributes(const std::string& fullPath, FileSystem::Attributes attributes)
+{
+    m_operations.push_back({Operation::SetAttributes, fullPath, attributes, std::string()});
+}
+
+void Transaction::deleteEntry(const std::string& fullPath)
+{
+    m_operations.push_back({Operation::DeleteEntry, fullPath, 0, std::string()});
+}
+
+bool Transaction::commit()
+{
+    bool succeeded = m_fs.commitTransaction(*this);
+    m_operations.clear();
+    return succeeded;
+}
+
+std::vector<std::shared_ptr<Entry>> Entry::getChildren()
 {
     std::vector<std::shared_ptr<Entry>> ret;
     if (!isDir()) return ret; // 非目录则返回空列表
 
     // 申请缓存空间
     char* buffer = new char[Disk::kSectorSize];
-    m_disk.read(buffer, m_blockStart);
+    if (m_snapshot != nullptr) // 快照中的目录块不会再改变，不需要加锁
+    {
+        const auto& data = m_snapshot->m_dirs.at(m_blockStart);
+        std::copy(data.begin(), data.end(), buffer);
+    }
+    else
+    {
+        std::shared_lock<std::shared_mutex> dirLock(m_fs.m_dirLocks[m_blockStart]); // 不会读到修改了一半的目录块
+        if (!m_fs.readBlock(buffer, m_blockStart)) // 目录块已损坏
+        {
+            delete[] buffer;
+            return ret;
+        }
+    }
 
     for (int i = 0; i != FileSystem::kMaxChildEntries; ++i)
     {
@@ -575,12 +2641,19 @@ std::vector<std::shared_ptr<Entry>> Entry::getChildren()
         if (!FileSystem::checkName(name)) // 名字无效，这个目录项为空
             continue;                     // 继续查找下一目录项
         // 找到目录项，生成 Entry
-        std::shared_ptr<Entry> entry(new Entry(m_disk));
+        std::shared_ptr<Entry> entry(new Entry(m_fs));
         entry->m_parent = self();
+        entry->m_snapshot = m_snapshot;
         entry->m_name = name;
-        entry->m_attributes = entryPointer[FileSystem::kEntryAttributesIndex];
-        entry->m_blockStart = entryPointer[FileSystem::kEntryBlockStartIndex];
-        entry->m_numBlock = entryPointer[FileSystem::kEntryNumOfBlocksIndex];
+        entry->m_attributes = FileSystem::getAttributesFromEntryPointer(entryPointer);
+        entry->m_blockStart = FileSystem::getBlockStartFromEntryPointer(entryPointer);
+        entry->m_size = FileSystem::getSizeFromEntryPointer(entryPointer);
+        entry->m_entryIndex = i;
+        if (entryPointer[FileSystem::kEntryAttributesIndex] & FileSystem::kInlineFlag)
+        {
+            char* data = entryPointer + FileSystem::kEntryInlineDataIndex;
+            entry->m_inlineData.assign(data, data + entry->m_size);
+        }
         // 加入返回结果集
         ret.push_back(entry);
     }
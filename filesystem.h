@@ -12,16 +12,27 @@
 #define TOYFS_FILESYSTEM_H_
 
 #include "disk.h"
+#include "executor.h"
+#include "iosched.h"
+#include "trace.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
 #include <list>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
 #include <vector>
 
 class Entry;
+class Snapshot;
+class Transaction;
 
 class FileSystem
 {
@@ -29,9 +40,11 @@ public:
     static const int kBlockSize = 64;      // 块大小，本程序为了简便等于磁盘扇区大小
     static const int kEntrySize = 8;       // 目录项大小
     static const int kMaxChildEntries = 8; // 一个目录最大的目录项数
-    static const int kMaxOpenedFiles = 5;
+    static const int kMaxOpenedFiles = 1 << 16;
     static const int kRawFileNameLength = 5;
-    static const int END_OF_FILE = '#';
+    static const int kMaxBlocksPerFile = 256;                   // 逻辑块号用一个字节记录
+    static const int kMaxFileSize = kMaxBlocksPerFile * kBlockSize; // 不超过目录项中 16 位的文件大小
+    static const int kMaxRefCount = 127;                            // 引用计数表的表项是一个有符号字节
     static_assert(kEntrySize * kMaxChildEntries == kBlockSize, "Mismatch constants.");
 
     enum Attribute
@@ -39,7 +52,8 @@ public:
         ReadOnly = 1,
         System = 2,
         File = 4,
-        Directory = 8
+        Directory = 8,
+        Compressed = 16 // 文件数据按压缩单元压缩存储，只能在文件为空时设置或取消
     };
     using Attributes = int;
 
@@ -50,6 +64,76 @@ public:
     };
     using OpenModes = int;
 
+    // 分散/聚集读写的一个数据段
+    struct IoVec
+    {
+        char* base;
+        int length;
+    };
+
+    // 文件状态
+    // 文件可以有空洞（没有分配块的区域），所以占用的空间 numOfBlocks * kBlockSize 可能小于 size
+    struct Stat
+    {
+        Attributes attributes;
+        int size;                // 文件的逻辑字节数
+        int numOfBlocks;         // 实际分配的块数
+        double compressionRatio; // 压缩文件的大小与占用空间之比，未压缩或者没有分配块时为 1
+    };
+
+    // 块校验和的统计信息
+    struct ChecksumStats
+    {
+        long verified; // 校验过的读取次数
+        long failures; // 校验失败的次数
+    };
+
+    // I/O 调度器的统计信息，见 toyfs::IoScheduler::Stats
+    using IoStats = toyfs::IoScheduler::Stats;
+
+    // 组提交的统计信息，并发的 sync 合并为一次写回时 flushes 小于 syncs
+    struct CommitStats
+    {
+        long syncs;   // sync 的调用次数
+        long flushes; // 实际写回的次数
+    };
+
+    // 元数据日志的统计信息
+    struct JournalStats
+    {
+        long records;     // 提交的日志记录数
+        long blocks;      // 日志记录中的元数据块数
+        long checkpoints; // 检查点次数
+        long replayed;    // 挂载时重放的日志记录数
+    };
+
+    // 一致性检查的结果
+    struct FsckReport
+    {
+        int directories;    // 检查的目录数
+        int files;          // 检查的文件数
+        int badEntries;     // 指向无效块、空闲块或已被占用的块的目录项
+        int brokenChains;   // 指向无效块、空闲块或逻辑块号不递增（包括成环）的块链
+        int refCountErrors; // 引用计数与实际的引用数不符的块，包括交叉链接
+        int leakedBlocks;   // 已分配但没有被引用的块
+        bool repaired;      // 是否修复了发现的问题
+    };
+
+    // 批量装入的一个目录或文件
+    struct BulkEntry
+    {
+        std::string fullPath;
+        bool isDir;
+        std::string data; // 文件内容
+    };
+
+    // 解压缓存的统计信息
+    struct CacheStats
+    {
+        long hits;
+        long misses;
+    };
+
     // constructors & destructor
     explicit FileSystem(Disk& disk);
     ~FileSystem();
@@ -58,6 +142,17 @@ public:
     FileSystem& operator=(const FileSystem&) = delete;
 
     bool initFileSystem();
+    /**
+     * @brief bulkLoad 初始化文件系统并一次装入整棵目录树，原有的数据都被清除。
+     *
+     * 先在内存中规划好布局：按深度优先的顺序，每个目录块之后紧跟着它的文件的连续块，然后才是子目录。
+     * 数据块和子目录块按块号顺序成批写入，最后根目录块和各表作为一条日志记录提交。
+     * 缺少的父目录自动补上。
+     *
+     * @param entries 要装入的目录和文件，顺序即目录项的顺序。
+     * @return true if succeeded. 名称无效、目录项过多、文件过大时不修改文件系统，空间不足时文件系统为空。
+     */
+    bool bulkLoad(const std::vector<BulkEntry>& entries);
 
     std::shared_ptr<Entry> rootEntry();
     std::shared_ptr<Entry> getEntry(const std::string& fullPath);
@@ -69,19 +164,231 @@ public:
     bool createFile(std::shared_ptr<Entry> parent, const std::string& fileName, Attributes attributes);
     bool openFile(const std::string& fullPath, OpenModes openModes);
     bool closeFile(const std::string& fullPath);
+    /**
+     * @brief open 打开文件并返回文件描述符。
+     *
+     * 文件已经打开时返回已有的描述符并增加其引用计数，每次 open 都要对应一次 close。
+     * 描述符中缓存了起始块、块链位置和父目录项位置，read/write/close 不再需要解析路径。
+     * 线程安全。
+     *
+     * @param fullPath 文件绝对路径。
+     * @param openModes 打开方式。
+     * @return 成功时为非负的文件描述符，否则为 -1。
+     */
+    int open(const std::string& fullPath, OpenModes openModes);
+    /**
+     * @brief close 释放文件描述符的一个引用，引用计数为零时关闭文件。
+     * @return true if succeeded.
+     */
+    bool close(int fd);
+    /**
+     * @brief read 从文件描述符的读指针处读取数据。
+     * @return 实际读取的字节数。
+     */
+    int read(int fd, char* buf_out, int length);
+    /**
+     * @brief write 在文件描述符的写指针处追加数据。
+     * @return true if succeeded.
+     */
+    bool write(int fd, const char* buf_in, int length);
+    /**
+     * @brief readAt 从文件的 offset 处读取数据。
+     *
+     * 不使用也不修改读指针，多个线程可以在同一个描述符上并发调用。
+     *
+     * @return 实际读取的字节数。
+     */
+    int readAt(int fd, int offset, char* buf_out, int length);
+    /**
+     * @brief writeAt 在文件的 offset 处写入数据。
+     *
+     * 覆盖已有的块，写到文件尾之后时才扩展文件。中间的空隙成为空洞，不分配块，读取时为零。
+     * 不使用也不修改写指针。
+     *
+     * @return true if succeeded.
+     */
+    bool writeAt(int fd, int offset, const char* buf_in, int length);
+    /**
+     * @brief readv 从文件描述符的读指针处依次读入 iovcnt 个数据段，作为一次读操作完成。
+     * @return 实际读取的总字节数。
+     */
+    int readv(int fd, const IoVec* iov, int iovcnt);
+    /**
+     * @brief writev 在文件描述符的写指针处依次写入 iovcnt 个数据段。
+     *
+     * 作为一次写操作完成：只遍历一次块链，FAT 和目录项都只在最后更新一次。
+     *
+     * @return true if succeeded.
+     */
+    bool writev(int fd, const IoVec* iov, int iovcnt);
     bool isOpened(const std::string& fullPath);
     std::vector<std::string> getOpenedFiles();
     std::unique_ptr<std::string> readFile(const std::string& fullPath, int length);
     int readFile(const std::string& fullPath, char* buf_out, int length);
     bool writeFile(const std::string& fullPath, const char* buf_in, int length);
     bool setFileAttributes(const std::string& fullPath, Attributes attributes);
+    /**
+     * @brief stat 获取文件或目录的状态。
+     *
+     * @param fullPath 绝对路径。
+     * @param st 用于存放结果。
+     * @return true if succeeded.
+     */
+    bool stat(const std::string& fullPath, Stat& st);
+    /**
+     * @brief stat 获取已打开文件的状态。
+     * @return true if succeeded.
+     */
+    bool stat(int fd, Stat& st);
+
+    /**
+     * @brief clone 以写时复制的方式复制文件。
+     *
+     * 新文件与源文件共享所有的块，只需要写一个目录项。任一文件写入共享的块时才复制这些块。
+     * 链头的引用计数达到 kMaxRefCount 时失败。
+     *
+     * @param srcPath 源文件绝对路径。
+     * @param dstPath 新文件绝对路径。
+     * @return true if succeeded.
+     */
+    bool clone(const std::string& srcPath, const std::string& dstPath);
+    /**
+     * @brief snapshot 创建文件系统当前状态的只读快照。
+     *
+     * 只复制目录块，文件数据与 clone 一样通过增加链头的引用计数共享，之后的写入按写时复制进行。
+     * 创建时短暂地阻塞所有修改，之后快照不影响读写。快照必须在文件系统之前释放。
+     *
+     * @return 快照，失败时为 nullptr。
+     */
+    std::shared_ptr<Snapshot> snapshot();
+    /**
+     * @brief beginTransaction 开始一个事务，事务中的一组修改要么全部生效，要么都不生效。
+     * @return 事务，调用 Transaction::commit 后生效。
+     */
+    std::unique_ptr<Transaction> beginTransaction();
+
+    // 异步接口：在内部的工作线程上执行对应的同步调用并立即返回，结果通过 future 取得
+    // 调用者需保证缓冲区在 future 就绪之前有效
+    /**
+     * @brief asyncRead 异步的 readAt。
+     * @return 实际读取的字节数。
+     */
+    std::future<int> asyncRead(int fd, int offset, char* buf_out, int length);
+    /**
+     * @brief asyncWrite 异步的 writeAt。
+     * @return true if succeeded.
+     */
+    std::future<bool> asyncWrite(int fd, int offset, const char* buf_in, int length);
+    /**
+     * @brief asyncCreate 异步的 createFile。
+     * @return true if succeeded.
+     */
+    std::future<bool> asyncCreate(const std::string& fullPath, Attributes attributes);
+    /**
+     * @brief asyncGetEntry 异步的 getEntry。
+     * @return 目录项，不存在时为 nullptr。
+     */
+    std::future<std::shared_ptr<Entry>> asyncGetEntry(const std::string& fullPath);
 
     bool deleteEntry(const std::string& fullPath);
     bool deleteEntry(std::shared_ptr<Entry> entry);
 
+    /**
+     * @brief sync 写回校验和表并刷新磁盘，返回时之前的所有更改都已持久化。
+     *
+     * 并发的调用者组成一个提交组，只写回一次，同时返回。
+     *
+     * @return true if succeeded.
+     */
     bool sync();
+    CommitStats commitStats();
+
+    /**
+     * @brief checkpoint 确认日志中的记录都已写回原位置并持久化，然后清空日志。
+     *
+     * 日志用过一半时会在后台自动做检查点，日志满时提交会等待检查点完成。
+     *
+     * @return true if succeeded.
+     */
+    bool checkpoint();
+    JournalStats journalStats();
+
+    /**
+     * @brief fsck 检查目录树、FAT、逻辑块号表和引用计数表是否一致，可以同时修复。
+     *
+     * 同一层的目录块在专用的线程上并行读取，每个元数据块只读取和检查一次。
+     * 修复时删除无效的目录项、清空指向无效块的文件、在断开处截断块链、回收泄漏的块并改正引用计数。
+     * 存在的快照引用的块链与文件一样检查，即使原来的文件已经删除或改写也不算泄漏。
+     * 检查期间其他线程的修改操作等待；有打开的文件时不能修复。
+     *
+     * @param report 用于存放结果。
+     * @param repair 是否修复。
+     * @return 没有发现问题或者问题都已修复时为 true。
+     */
+    bool fsck(FsckReport& report, bool repair);
+
+    /**
+     * @brief setChecksumVerification 设置读取时是否校验块的 CRC32C 校验和，默认校验。
+     *
+     * 写入时总是更新校验和，关闭校验后再打开也不会漏掉期间写入的块。
+     */
+    void setChecksumVerification(bool enabled);
+    ChecksumStats checksumStats();
+
+    /**
+     * @brief decompressionCacheStats 获取压缩文件解压缓存的命中统计。
+     */
+    CacheStats decompressionCacheStats();
+
+    /**
+     * @brief setIoLatencyBudget 设置 I/O 调度器派发前等待更多请求的最长时间（微秒），默认为零。
+     *
+     * 并发的请求越多，等待后能合并的相邻扇区越多，但每次读写的延迟也越长。
+     */
+    void setIoLatencyBudget(int microseconds);
+    /**
+     * @brief ioStats 获取 I/O 调度器的队列深度和合并统计。
+     */
+    IoStats ioStats();
+
+    /**
+     * @brief startTrace 开始把公开接口的调用记录到文件，已经在记录时换成新文件。
+     *
+     * 记录每次调用的操作、路径或描述符、偏移和长度、开始时间、耗时和线程，不记录数据内容。
+     * 公开接口内部嵌套的调用（例如 createFile 顺便打开文件）不单独记录，异步调用记录为工作线程上的同步调用。
+     * initFileSystem、bulkLoad、snapshot 和 fsck 不记录。
+     * 不记录时每次调用只多检查一个原子变量。
+     *
+     * @param path 记录文件的路径，toyfs::TraceReader 可以读回。
+     * @return true if succeeded.
+     */
+    bool startTrace(const std::string& path);
+    /**
+     * @brief stopTrace 停止记录，正在进行的调用结束后记录文件关闭。
+     */
+    void stopTrace();
 
 private:
+    // 目录项格式：文件名（不足 4 字节时以 '$' 结束）、属性、起始块号、文件字节数（16 位，小端）
+    // 属性字节带有 kInlineFlag 时，文件数据内嵌在起始块号和文件字节数的位置，字节数记录在属性字节的高两位
+    static const int kEntryNameLength = kRawFileNameLength - 1;
+    static const int kEntryAttributesIndex = 4;
+    static const int kEntryBlockStartIndex = 5;
+    static const int kEntrySizeIndex = 6;
+    static const int kEntryInlineDataIndex = kEntryBlockStartIndex;
+    static const int kInlineFlag = 32;
+    static const int kInlineSizeShift = 6;
+    static const int kMaxInlineSize = kEntrySize - kEntryInlineDataIndex;
+    static_assert(kMaxInlineSize < (1 << (8 - kInlineSizeShift)), "Mismatch constants.");
+
+    // 块链上的一个位置
+    // 块链按逻辑块号递增排列，空洞不在链上；{-1, -1} 表示位于链头之前
+    struct ChainPosition
+    {
+        int index; // 逻辑块号
+        int block; // 对应的块号
+    };
+
     // 文件描述符
     struct OpenedFile
     {
@@ -89,59 +396,357 @@ private:
         Attributes attributes;
         int blockNumber;
         int numOfBlocks;
+        int size; // 文件的字节数
         OpenModes modes;
         int g; // get pointer
         int p; // put pointer
+        ChainPosition cached; // 缓存的块链位置，顺序读写时不必每次从头遍历 FAT
+        // 目录项位置，修改文件大小时不必重新解析路径
+        int parentBlock; // 父目录块号
+        int entryIndex;  // 在父目录块中的目录项序号
+        // 很小的文件内嵌在目录项中，没有块
+        bool inlined;
+        char inlineData[kMaxInlineSize];
+
+        int refCount;            // 引用计数，由所在分片的锁保护
+        std::shared_mutex mutex; // 保护读写指针和块链缓存，只读取数据时加读锁
     };
 
-    static const int kEntryAttributesIndex = 5;
-    static const int kEntryBlockStartIndex = 6;
-    static const int kEntryNumOfBlocksIndex = 7;
+    // 打开文件表的一个分片，按路径的哈希值分片以减少锁竞争
+    // 描述符 fd 位于分片 fd % kNumOfFdShards 的第 fd / kNumOfFdShards 个槽位
+    struct FdShard
+    {
+        std::mutex mutex;
+        std::unordered_map<std::string, int> paths;     // 路径到描述符的索引
+        std::vector<std::shared_ptr<OpenedFile>> slots; // 描述符槽位
+        std::vector<int> freeSlots;                     // 空闲的槽位
+    };
+    static const int kNumOfFdShards = 64;
+    static const int kMaxSlotsPerShard = kMaxOpenedFiles / kNumOfFdShards;
 
-    const int kFatSize;         // FAT 大小
-    const int kNumOfFatBlocks;  // FAT 占用的块数
-    const int kRootBlockNumber; // 根目录起始块地址
+    // 压缩文件的第 u 个压缩单元占用从逻辑块号 u * kCompressionUnitBlocks 开始的连续若干块：
+    // 没有块时是空洞；占满 kCompressionUnitBlocks 块时按原样存储；
+    // 否则首字节为压缩数据的长度，其后为压缩数据，解压后不足一个单元的部分为零
+    static const int kCompressionUnitBlocks = 4;
+    static const int kCompressionUnitSize = kCompressionUnitBlocks * kBlockSize;
+    static const int kMaxCompressedSize = (kCompressionUnitBlocks - 1) * kBlockSize - 1;
+    static const int kNumOfCachedUnits = 16; // 解压缓存的容量（压缩单元数）
+    static const int kChecksumSize = 4;
+    static const int kNumOfAsyncWorkers = 4; // 执行异步调用的工作线程数
+    static const int kNumOfFsckThreads = 4;  // fsck 并行读取目录块的线程数
+    static const int kChecksumsPerBlock = kBlockSize / kChecksumSize;
+
+    // 元数据日志位于磁盘末尾的 kNumOfJournalBlocks 个块
+    // 第一块是日志超级块：魔数、第一条有效记录的序号（小端）
+    // 其后是依次追加的日志记录：一个记录头块，后面是各元数据块的新内容
+    // 记录头：魔数、序号、块数、各块的原位置块号，最后 4 字节是记录头和各块内容的 CRC32C
+    // 日志块有自己的 CRC32C，不记录在校验和表中
+    static const int kNumOfJournalBlocks = 16;
+    static const std::uint32_t kJournalMagic = 0x4c4e524a; // "JRNL"
+    static const int kJournalSeqIndex = 4;
+    static const int kJournalCountIndex = 8;
+    static const int kJournalHomeIndex = 9;
+    static const int kJournalCrcIndex = kBlockSize - 4;
+    static const int kMaxJournalRecordBlocks = kNumOfJournalBlocks - 2; // 一条记录最多的元数据块数
+
+    // 修改文件系统的公开接口持有事务锁的读锁，提交事务时持有写锁
+    // 同一线程嵌套调用或者正在提交事务时不再重复加锁
+    class UpdateLock
+    {
+    public:
+        explicit UpdateLock(FileSystem& fs);
+        ~UpdateLock();
+
+    private:
+        FileSystem* m_fs; // 没有加锁时为 nullptr
+    };
+
+    // 记录一次公开接口的调用，析构时追加到调用记录
+    // 同一线程中嵌套在另一个 TraceScope 之内的调用不记录，默认构造的 TraceScope 只用于屏蔽内部的调用
+    class TraceScope
+    {
+    public:
+        TraceScope();
+        TraceScope(FileSystem& fs, toyfs::TraceOp op, const std::string& path, int length = 0, int flags = 0);
+        TraceScope(FileSystem& fs, toyfs::TraceOp op, int handle, int offset = 0, int length = 0, int flags = 0);
+        ~TraceScope();
+        void setHandle(int handle);               // open 返回的描述符
+        void setPath2(const std::string& path2); // clone 的目标路径
+
+    private:
+        std::shared_ptr<toyfs::TraceWriter> m_writer; // 不记录时为空
+        toyfs::TraceRecord m_record;
+    };
+
+    // 一个要写入日志的元数据块
+    struct MetadataBlock
+    {
+        int block;        // 原位置块号
+        const char* data; // 新内容
+    };
+
+    // 一个提交组，组内的 sync 调用共享一次写回
+    struct CommitGroup
+    {
+        bool done = false;
+        bool succeeded = false;
+    };
+
+    // 解压缓存中的一个压缩单元，以它的第一个块号为键
+    struct CachedUnit
+    {
+        int block;
+        char data[kCompressionUnitSize];
+    };
+
+    const int kFatSize;          // FAT 大小
+    const int kNumOfFatBlocks;   // FAT 占用的块数
+    const int kIndexBlockNumber;    // 逻辑块号表起始块地址，大小与 FAT 相同
+    const int kRefCountBlockNumber; // 引用计数表起始块地址，大小与 FAT 相同
+    const int kChecksumBlockNumber; // 校验和表起始块地址，每个块一个 4 字节的校验和，校验和表本身不校验
+    const int kNumOfChecksumBlocks; // 校验和表占用的块数
+    const int kRootBlockNumber;     // 根目录起始块地址
+    const int kJournalBlockNumber;  // 元数据日志起始块地址，位于磁盘末尾
 
     Disk& m_disk;
+    toyfs::IoScheduler m_scheduler; // 所有的块读写都经过调度器排序、合并后再访问磁盘
     char* m_fat;
-    char* m_buffer;
+    char* m_blockIndex; // 逻辑块号表，记录每个数据块是所属文件的第几块
+    char* m_refCount;   // 引用计数表，记录指向每个块的目录项和 FAT 表项的个数，大于 1 表示被共享
+    // 快照对各文件链头的引用数，由 FAT 锁保护。只在内存中，不写入引用计数表，崩溃后不会留下快照的引用
+    std::vector<int> m_snapshotPins;
     std::shared_ptr<Entry> m_rootEntry;
-    std::unordered_map<std::string, std::shared_ptr<OpenedFile>> m_openedFiles;
+    FdShard m_fdShards[kNumOfFdShards]; // 打开文件表
+    std::list<CachedUnit> m_unitCache;  // 解压缓存，最近使用的在前
+    std::unordered_map<int, std::list<CachedUnit>::iterator> m_unitCacheIndex;
+    CacheStats m_cacheStats;
+    CommitStats m_commitStats;
+    std::shared_ptr<CommitGroup> m_pendingCommit; // 等待写回的提交组，为空表示没有
+    bool m_committing;                            // 是否有提交组正在写回
+    std::condition_variable m_commitCond;
+    std::unique_ptr<std::atomic<std::uint32_t>[]> m_checksums; // 校验和表，0 表示没有记录
+    std::unique_ptr<std::atomic<bool>[]> m_checksumDirty;      // 校验和表的各块是否需要写回
+    std::atomic<bool> m_verifyChecksums;
+    std::atomic<long> m_checksumsVerified;
+    std::atomic<long> m_checksumFailures;
+    char* m_committedTables; // 最近一次提交的 FAT、逻辑块号表和引用计数表，用于找出修改过的块
+    bool m_tablesCommitted;  // m_committedTables 是否有效
+    int m_journalHead;           // 下一条日志记录的位置
+    std::uint32_t m_journalSeq;  // 下一条日志记录的序号
+    int m_journalInFlight;       // 已写入日志但还没有写回原位置的记录数
+    bool m_checkpointScheduled;  // 是否已经安排了后台检查点
+    std::vector<bool> m_journalPinned; // 日志中有记录的目录块，检查点之前不能分配，否则重放时会覆盖新内容
+    JournalStats m_journalStats;
+    std::condition_variable m_journalCond;
+    std::unique_ptr<toyfs::Executor> m_executor; // 执行异步调用和后台检查点
+    std::atomic<std::thread::id> m_transactionOwner; // 正在提交事务的线程
+    std::unordered_map<int, std::vector<char>> m_transactionBlocks; // 事务中推迟提交的目录块，只由提交事务的线程访问
+    std::vector<bool> m_transactionFreed; // 事务中释放的块，提交或撤销之前不能分配，撤销时它们回到链上
+    std::atomic<bool> m_tracing;                 // 是否在记录调用，不记录时不必读取 m_trace
+    std::shared_ptr<toyfs::TraceWriter> m_trace; // 调用记录，用 std::atomic_load/atomic_store 访问
 
     // 互斥锁
-    // 注意：如需占用多个锁，请按顺序加锁
-    std::mutex m_mutex1Fat;
-    std::mutex m_mutex2Buffer;
+    // 注意：如需占用多个锁，请按顺序加锁：
+    // m_mutex0Transaction -> 打开文件表分片锁 FdShard::mutex -> 文件描述符锁 OpenedFile::mutex -> 目录锁（先父目录后子目录）
+    // -> m_mutex1Fat -> m_mutex2Journal -> m_mutex3Cache -> m_mutex4Checksum
+    // m_mutex5Commit 不在写回期间持有，写回时会获取 m_mutex4Checksum；持有 m_mutex2Journal 时可以调用 sync
+    std::shared_mutex m_mutex0Transaction;           // 事务锁，提交事务时没有其他线程修改文件系统
+    std::unique_ptr<std::shared_mutex[]> m_dirLocks; // 目录锁，以目录块号为下标，保护目录块的内容
+    std::shared_mutex m_mutex1Fat;                   // 保护 FAT、逻辑块号表和引用计数表，只读取时加读锁
+    std::mutex m_mutex2Journal;                      // 保护日志的写入位置、序号和统计
+    std::mutex m_mutex3Cache;                        // 保护解压缓存
+    std::mutex m_mutex4Checksum;                     // 串行化校验和表的写回
+    std::mutex m_mutex5Commit;                       // 保护组提交的状态
+
+    // 事务相关函数
+    bool inTransaction(); // 当前线程是否正在提交事务
+    /**
+     * @brief commitTransaction 依次执行事务中的操作，所有的目录块和各表作为一条日志记录提交。
+     *
+     * 任一操作失败时恢复各表并丢弃事务中修改的目录块。已写入的数据块都是新分配的或位于文件尾之后，不用恢复；
+     * 事务中释放的块到事务结束前都不会再分配，新分配的块不会是撤销后还要用的块。
+     * 压缩文件的单元要整个重写，事务中改写的单元也写到新分配的块上。
+     *
+     * @return true if succeeded.
+     */
+    bool commitTransaction(const Transaction& transaction);
+
+    // 读写块，写入时更新校验和，读取时校验
+    bool readBlock(char* buf, int block);
+    bool writeBlock(const char* buf, int block);
+    bool flushChecksums(); // 写回校验和表中修改过的块，由 flush 调用
+    bool flush();          // 以组提交写回校验和表并刷新磁盘，与 sync 不同，在事务中也不跳过
 
-    // FAT 相关函数
+    // FAT 相关函数，逻辑块号表和引用计数表随 FAT 一起读写
     bool loadFat();
+    /**
+     * @brief saveFat 通过日志提交 FAT、逻辑块号表和引用计数表中修改过的块，调用者需持有 FAT 的写锁。
+     * @return true if succeeded.
+     */
     bool saveFat();
+
+    // 元数据日志相关函数
+    /**
+     * @brief commitMetadata 把一个操作修改的元数据块作为一条日志记录追加并持久化，再写回原位置。
+     *
+     * 写回原位置的块不立即持久化，由之后的 sync 或检查点完成，崩溃后挂载时重放日志。
+     *
+     * @param blocks 修改过的目录块，调用者需持有这些目录的写锁。
+     * @param withTables 是否同时提交 FAT 等表中修改过的块，为 true 时调用者需持有 FAT 的写锁。
+     * @return true if succeeded.
+     */
+    bool commitMetadata(std::vector<MetadataBlock> blocks, bool withTables);
+    bool checkpoint(std::unique_lock<std::mutex>& journalLock); // 调用者持有 m_mutex2Journal
+    bool writeJournalSuperblock();
+    /**
+     * @brief replayJournal 挂载时把日志中完整的记录依次写回原位置，然后清空日志。
+     * @return true if succeeded.
+     */
+    bool replayJournal();
     /**
      * @brief nextAvailableBlock
      * @return 如果有可用块则为可用块号，否则为 -1。
      */
     int nextAvailableBlock();
+    int blockIndex(int block) { return static_cast<unsigned char>(m_blockIndex[block]); }
+    int references(int block) { return m_refCount[block] + m_snapshotPins[block]; } // 包括快照的引用
+    /**
+     * @brief insertBlock 分配一个新块作为文件的第 index 块，插入到块链位置 pos 之后。
+     * @param firstBlock 文件的起始块号，新块插在链头时被修改。
+     * @param pos 插入位置，之后移到新块处。
+     * @return 新块的块号，没有可用块时为 -1。
+     */
+    int insertBlock(int& firstBlock, ChainPosition& pos, int index);
+    /**
+     * @brief unshareChain 复制块链中被共享的、逻辑块号不超过 lastIndex 的块，使它们只属于这个文件。
+     *
+     * 块被共享时它之后的块也都被共享，因此从第一个共享的块开始复制，复制出的块链接回剩余的共享部分。
+     *
+     * @param firstBlock 文件的起始块号，链头被复制时被修改。
+     * @return 复制的块数，没有足够的块可供分配时为 -1。
+     */
+    int unshareChain(int& firstBlock, int lastIndex);
+    /**
+     * @brief releaseChain 释放一个对块链的引用，引用计数降为零的块被回收。
+     */
+    void releaseChain(int firstBlock);
     /**
-     * @brief findNextNBlock
-     * @param firstBlock
-     * @param n
-     * @return firstBlock 之后 n 块的块号，如果结果不存在，返回 -1。
+     * @brief unpinChain 释放快照对块链的引用，没有其他引用时回收整条链。
      */
-    int findNextNBlock(int firstBlock, int n);
+    void unpinChain(int firstBlock);
+    /**
+     * @brief reclaimOrphanedChains 挂载时回收已分配但引用计数为零的块链。
+     *
+     * 快照存在期间被删除或改写的块只由快照引用，崩溃时它们在磁盘上已分配、引用计数为零。
+     *
+     * @return true if succeeded.
+     */
+    bool reclaimOrphanedChains();
+    int numOfAvailableBlocks();
 
+    // 文件描述符相关函数
+    /**
+     * @brief openFileDescriptor 打开文件。
+     * @param addReference 文件已经打开时是否增加引用计数，按路径读写的接口不增加。
+     * @return 文件描述符，失败时为 -1。
+     */
+    int openFileDescriptor(const std::string& fullPath, OpenModes openModes, bool addReference);
+    std::shared_ptr<OpenedFile> getOpenedFile(int fd);
+    FdShard& fdShardOf(const std::string& fullPath);
+    /**
+     * @brief seekBlock 从块链位置 pos 出发找到文件的第 index 块，并把 pos 移到链上最后一个不超过 index 的位置。
+     * @param firstBlock 文件的起始块号，pos 在目标之后时从头开始找。
+     * @return 块号，如果该块是空洞，返回 -1。
+     */
+    int seekBlock(int firstBlock, ChainPosition& pos, int index);
+    /**
+     * @brief readData 从文件的 offset 处读取数据依次存入各数据段，不超过文件尾。
+     * @return 实际读取的字节数。
+     */
+    int readData(Attributes attributes, int firstBlock, int size, ChainPosition& pos, int offset, const IoVec* iov,
+                 int iovcnt);
+    /**
+     * @brief writeData 在文件的 offset 处依次写入各数据段并更新目录项中的文件大小，调用者需持有 of.mutex。
+     * @return 实际写入的字节数。
+     */
+    int writeData(OpenedFile& of, int offset, const IoVec* iov, int iovcnt);
+    /**
+     * @brief saveEntry 把描述符中的属性、起始块和文件大小（或内嵌数据）写回目录项，持有父目录的写锁。
+     * @param withTables 是否把 FAT 等表中修改过的块与目录块作为同一条日志记录提交，为 true 时加 FAT 的写锁。
+     * @return true if succeeded.
+     */
+    bool saveEntry(const OpenedFile& of, bool withTables);
+    // 内嵌文件相关函数
+    int readInline(const char* data, int size, int offset, const IoVec* iov, int iovcnt);
+    /**
+     * @brief writeInline 写入内嵌文件，写入后不超过 kMaxInlineSize 时使用，只需要读写一次目录块。
+     * @return 实际写入的字节数。
+     */
+    int writeInline(OpenedFile& of, int offset, const IoVec* iov, int iovcnt);
+
+    // 压缩文件相关函数
+    int readCompressed(int firstBlock, int size, ChainPosition& pos, int offset, const IoVec* iov, int iovcnt);
+    int writeCompressed(OpenedFile& of, int offset, const IoVec* iov, int iovcnt);
+    /**
+     * @brief loadUnit 读出并解压第 unit 个压缩单元，优先使用解压缓存。
+     * @param data 用于存放解压后的 kCompressionUnitSize 个字节。
+     * @return true if succeeded.
+     */
+    bool loadUnit(int firstBlock, ChainPosition& pos, int unit, char* data);
+    /**
+     * @brief storeUnit 压缩并写入第 unit 个压缩单元，按压缩后的大小增减该单元占用的块。
+     *
+     * 修改过的 FAT 等表不在这里提交，由调用者写完所有单元后与目录项一起提交。
+     *
+     * @param length 单元中有效数据的字节数，之后的部分为零。
+     * @param fatChanged 修改了 FAT 等表时设为 true。
+     * @return true if succeeded.
+     */
+    bool storeUnit(OpenedFile& of, int unit, const char* data, int length, bool& fatChanged);
+    bool findCachedUnit(int block, char* data);
+    void cacheUnit(int block, const char* data);
+    void dropCachedUnit(int block);
+    // 把 f 交给工作线程执行，返回其结果的 future
+    template <typename F>
+    std::future<std::invoke_result_t<F>> runAsync(F f)
+    {
+        auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::move(f));
+        auto result = task->get_future();
+        m_executor->submit([task]() { (*task)(); });
+        return result;
+    }
     // 实用函数
     static std::string getNameFromEntryPointer(char* p);
+    static void setNameToEntryPointer(char* p, const std::string& name);
+    static Attributes getAttributesFromEntryPointer(char* p);
+    static int getBlockStartFromEntryPointer(char* p);
+    static int getSizeFromEntryPointer(char* p);
+    static void setSizeToEntryPointer(char* p, int size);
+    static void setInlineDataToEntryPointer(char* p, Attributes attributes, const char* data, int size);
+    static std::uint32_t getUint32FromPointer(const char* p); // 小端
+    static void setUint32ToPointer(char* p, std::uint32_t value);
     static char* findChildEntryPointer(char* parentEntryPointer, const std::string& childName);
     static bool checkName(const std::string& name);
     static std::list<std::string> splitPath(const std::string& fullpath);
+    static int totalLength(const IoVec* iov, int iovcnt);
+    static double compressionRatio(const Stat& st); // 由属性、大小和块数计算
+    /**
+     * @brief contiguousSegment
+     * @return 数据段中 [offset, offset + n) 范围的数据位于同一个数据段内时为其地址，否则为 nullptr。
+     */
+    static char* contiguousSegment(const IoVec* iov, int iovcnt, int offset, int n);
+    static void gatherSegments(const IoVec* iov, int iovcnt, int offset, char* dst, int n);
+    static void scatterSegments(const IoVec* iov, int iovcnt, int offset, const char* src, int n);
 
     friend class Entry;
+    friend class Snapshot;
+    friend class Transaction;
 };
 
 class Entry : public std::enable_shared_from_this<Entry>
 {
 public:
-    Entry(Disk& disk) : m_disk(disk) {}
+    Entry(FileSystem& fs) : m_fs(fs) {}
 
     // bool isPathValid();
     bool isDir() { return m_attributes & FileSystem::Directory; }
@@ -153,7 +758,7 @@ public:
     std::string fullpath();
     std::shared_ptr<Entry> self() { return shared_from_this(); }
     std::shared_ptr<Entry> parent() { return m_parent; }
-    int size() { return m_numBlock * FileSystem::kBlockSize; }
+    int size() { return m_size; }
 
     /**
      * @brief getChildren
@@ -169,14 +774,52 @@ public:
     //    std::weak_ptr<Entry> addChild(const std::string& name);
 
 private:
-    Disk& m_disk;
+    FileSystem& m_fs;
     std::string m_name;
     FileSystem::Attributes m_attributes;
     int m_blockStart;
-    int m_numBlock;
+    int m_size;
+    int m_entryIndex;         // 在父目录块中的目录项序号
+    std::string m_inlineData; // 内嵌在目录项中的文件数据，不为空时文件没有块
     std::shared_ptr<Entry> m_parent;
+    const Snapshot* m_snapshot = nullptr; // 属于快照时从快照保存的目录块中读取子项
 
     friend class FileSystem;
+    friend class Snapshot;
+};
+
+/**
+ * @brief The Snapshot class 文件系统某一时刻的只读视图，由 FileSystem::snapshot 创建。
+ *
+ * 从快照得到的 Entry 只在快照存在期间有效。
+ */
+class Snapshot
+{
+public:
+    ~Snapshot();
+    // keep from copying
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    std::shared_ptr<Entry> rootEntry();
+    std::shared_ptr<Entry> getEntry(const std::string& fullPath);
+    bool exist(const std::string& fullPath);
+    /**
+     * @brief readAt 从快照中的文件的 offset 处读取数据。
+     * @return 实际读取的字节数，不是文件时为 0。
+     */
+    int readAt(const std::string& fullPath, int offset, char* buf_out, int length);
+
+private:
+    explicit Snapshot(FileSystem& fs);
+
+    FileSystem& m_fs;
+    std::shared_ptr<Entry> m_rootEntry;
+    std::unordered_map<int, std::vector<char>> m_dirs; // 目录块号到创建快照时的目录块内容
+    std::vector<int> m_pinnedChains;                   // 引用的文件链头，释放快照时减少引用
+
+    friend class FileSystem;
+    friend class Entry;
 };
 
 inline std::string Entry::fullpath()
@@ -189,4 +832,54 @@ inline std::string Entry::fullpath()
     return fullPath.substr(fullPath.find_first_not_of('/') - 1);
 }
 
+/**
+ * @brief The Transaction class 一组要么全部生效、要么都不生效的修改，由 FileSystem::beginTransaction 创建。
+ *
+ * 操作先记录下来，commit 时依次执行。所有修改过的目录块和表作为一条日志记录提交，只刷新一次磁盘。
+ * 事务不能涉及已经打开的文件。
+ */
+class Transaction
+{
+public:
+    void createDir(const std::string& fullPath);
+    void createFile(const std::string& fullPath, FileSystem::Attributes attributes);
+    /**
+     * @brief writeFile 在文件尾追加数据，数据在调用时复制。
+     */
+    void writeFile(const std::string& fullPath, const char* buf_in, int length);
+    void setFileAttributes(const std::string& fullPath, FileSystem::Attributes attributes);
+    void deleteEntry(const std::string& fullPath);
+    /**
+     * @brief commit 执行记录的所有操作，之后事务为空，可以继续使用。
+     *
+     * 执行期间其他线程的修改操作等待，读取不受影响且看不到事务中间的状态。
+     *
+     * @return 所有操作都成功时为 true，否则所有操作都不生效。
+     */
+    bool commit();
+
+private:
+    explicit Transaction(FileSystem& fs) : m_fs(fs) {}
+
+    struct Operation
+    {
+        enum Type
+        {
+            CreateDir,
+            CreateFile,
+            WriteFile,
+            SetAttributes,
+            DeleteEntry
+        } type;
+        std::string fullPath;
+        FileSystem::Attributes attributes;
+        std::string data; // 要追加的数据
+    };
+
+    FileSystem& m_fs;
+    std::vector<Operation> m_operations;
+
+    friend class FileSystem;
+};
+
 #endif // TOYFS_FILESYSTEM_H_
@@ -37,7 +37,9 @@ FilePropertiesDialog::~FilePropertiesDialog()
 
 void FilePropertiesDialog::on_pushButton_ok_clicked()
 {
+    // 对话框不修改压缩属性，保持原样
     FileSystem::Attributes newAttrs = FileSystem::File;
+    newAttrs |= m_fs->getEntry(m_filePath)->attributes() & FileSystem::Compressed;
     if (ui->checkBox_readOnly->isChecked())
     {
         newAttrs |= FileSystem::ReadOnly;
@@ -0,0 +1,134 @@
+#include "iosched.h"
+
+#include "disk.h"
+
+#include <algorithm>
+
+namespace toyfs
+{
+
+IoScheduler::IoScheduler(Disk& disk) :
+    m_disk(disk), m_dispatching(false), m_latencyBudget(0), m_stats({0, 0, 0, 0})
+{
+}
+
+bool IoScheduler::read(char* buf, int sector)
+{
+    Request request = {false, sector, buf, nullptr, false, false};
+    return submit(request);
+}
+
+bool IoScheduler::write(const char* buf, int sector)
+{
+    Request request = {true, sector, nullptr, buf, false, false};
+    return submit(request);
+}
+
+void IoScheduler::setLatencyBudget(std::chrono::microseconds budget)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_latencyBudget = budget;
+}
+
+IoScheduler::Stats IoScheduler::stats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+bool IoScheduler::submit(Request& request)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_queue.push_back(&request);
+    ++m_stats.requests;
+    m_cond.notify_all(); // 正在等待的派发者可能要看到队列变长
+
+    for (;;)
+    {
+        m_cond.wait(lock, [&]() { return request.done || !m_dispatching; });
+        if (request.done) return request.succeeded;
+
+        // 没有线程在派发，由本线程派发
+        m_dispatching = true;
+        if (m_latencyBudget.count() > 0)
+        {
+            m_cond.wait_for(lock, m_latencyBudget, [this]() { return m_queue.size() >= kMaxBatchSize; });
+        }
+        std::vector<Request*> batch;
+        batch.swap(m_queue);
+
+        lock.unlock();
+        int dispatches = dispatch(batch); // 不持锁访问磁盘，其他线程可以继续排队
+        lock.lock();
+
+        for (auto r : batch)
+        {
+            r->done = true;
+        }
+        m_stats.dispatches += dispatches;
+        ++m_stats.batches;
+        m_stats.maxQueueDepth = std::max(m_stats.maxQueueDepth, static_cast<long>(batch.size()));
+        m_dispatching = false;
+        m_cond.notify_all(); // 唤醒完成的请求，并让排队的请求选出下一个派发者
+    }
+}
+
+int IoScheduler::dispatch(std::vector<Request*>& batch)
+{
+    // 稳定排序：同一扇区的请求保持提交顺序
+    std::stable_sort(batch.begin(), batch.end(),
+                     [](const Request* a, const Request* b) { return a->sector < b->sector; });
+
+    int dispatches = 0;
+    char buffer[kMaxMergedSectors * Disk::kSectorSize];
+    for (std::size_t i = 0; i != batch.size();)
+    {
+        // 合并 [i, j) 范围的请求，覆盖扇区 [first, end)
+        // 读请求可以合并重复的扇区，写请求只合并紧接着的扇区
+        bool isWrite = batch[i]->isWrite;
+        int first = batch[i]->sector;
+        int end = first + 1;
+        std::size_t j = i + 1;
+        for (; j != batch.size() && batch[j]->isWrite == isWrite; ++j)
+        {
+            int sector = batch[j]->sector;
+            if (sector == end && end - first < kMaxMergedSectors)
+            {
+                ++end;
+            }
+            else if (!(sector < end && !isWrite))
+            {
+                break;
+            }
+        }
+
+        bool succeeded;
+        if (isWrite)
+        {
+            for (std::size_t k = i; k != j; ++k)
+            {
+                std::copy(batch[k]->writeBuf, batch[k]->writeBuf + Disk::kSectorSize,
+                          buffer + Disk::kSectorSize * (batch[k]->sector - first));
+            }
+            succeeded = m_disk.write(buffer, first, end - first);
+        }
+        else
+        {
+            succeeded = m_disk.read(buffer, first, end - first);
+            for (std::size_t k = i; k != j; ++k)
+            {
+                const char* src = buffer + Disk::kSectorSize * (batch[k]->sector - first);
+                std::copy(src, src + Disk::kSectorSize, batch[k]->readBuf);
+            }
+        }
+        for (std::size_t k = i; k != j; ++k)
+        {
+            batch[k]->succeeded = succeeded;
+        }
+        ++dispatches;
+        i = j;
+    }
+    return dispatches;
+}
+
+} // namespace toyfs
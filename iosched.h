@@ -0,0 +1,102 @@
+//===-- iosched.h - Elevator I/O scheduler in front of Disk ---------------===//
+//
+// The Toy FAT FileSystem
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Queues sector reads and writes from concurrent callers, sorts each batch by
+/// sector, merges runs of adjacent requests into multi-sector Disk I/Os and
+/// dispatches them in one ascending sweep.
+///
+/// There is no scheduler thread. The first caller that finds no dispatch in
+/// progress becomes the dispatcher: it optionally waits up to the latency
+/// budget for more requests, takes the whole queue as one batch and completes
+/// it. Requests that arrive meanwhile form the next batch, so under load the
+/// batches grow by themselves even with a zero budget.
+///
+//===----------------------------------------------------------------------===//
+#ifndef TOYFS_IOSCHED_H_
+#define TOYFS_IOSCHED_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+class Disk;
+
+namespace toyfs
+{
+
+class IoScheduler
+{
+public:
+    // 统计信息
+    // 合并率为 1 - dispatches / requests，平均队列深度为 requests / batches
+    struct Stats
+    {
+        long requests;      // 提交的请求数
+        long dispatches;    // 实际发给磁盘的读写次数，合并后少于请求数
+        long batches;       // 派发的批数
+        long maxQueueDepth; // 一批中最多的请求数
+    };
+
+    explicit IoScheduler(Disk& disk);
+    // keep from copying
+    IoScheduler(const IoScheduler&) = delete;
+    IoScheduler& operator=(const IoScheduler&) = delete;
+
+    /**
+     * @brief read 读一个扇区，返回时已经完成。
+     * @return true if succeeded.
+     */
+    bool read(char* buf, int sector);
+    /**
+     * @brief write 写一个扇区，返回时已经完成。
+     * @return true if succeeded.
+     */
+    bool write(const char* buf, int sector);
+
+    /**
+     * @brief setLatencyBudget 设置派发前等待更多请求的最长时间，默认为零（不等待）。
+     *
+     * 队列达到 kMaxBatchSize 个请求时不再等待。
+     */
+    void setLatencyBudget(std::chrono::microseconds budget);
+    Stats stats();
+
+private:
+    static const int kMaxBatchSize = 32;     // 一批最多的请求数，攒够后立即派发
+    static const int kMaxMergedSectors = 16; // 一次合并读写最多的扇区数
+
+    struct Request
+    {
+        bool isWrite;
+        int sector;
+        char* readBuf;
+        const char* writeBuf;
+        bool done;
+        bool succeeded;
+    };
+
+    bool submit(Request& request);
+    /**
+     * @brief dispatch 按扇区号排序并合并相邻的请求后依次读写磁盘，不持有 m_mutex。
+     * @return 实际读写磁盘的次数。
+     */
+    int dispatch(std::vector<Request*>& batch);
+
+    Disk& m_disk;
+    std::vector<Request*> m_queue;
+    bool m_dispatching; // 是否有线程正在派发
+    std::chrono::microseconds m_latencyBudget;
+    Stats m_stats;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+};
+
+} // namespace toyfs
+
+#endif // TOYFS_IOSCHED_H_
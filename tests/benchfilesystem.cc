@@ -0,0 +1,313 @@
+#include "disk.h"
+#include "filesystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// 用法：benchfilesystem [-d 磁盘映像] [-n 每项的操作次数] [-o 结果文件] [-b 基线文件] [-t 允许的退化比例]
+//
+// 结果以制表符分隔输出到标准输出，每行一项：名称、每秒操作数和各百分位延迟（微秒）。
+// 磁盘映像的位置决定了后端，例如放在 /dev/shm 下就是内存盘。
+// 用 -o 保存的结果可以作为之后运行的 -b 基线，每秒操作数低于基线的 (1 - t) 倍时报告退化并返回 1。
+
+namespace
+{
+
+struct Result
+{
+    string name;
+    double opsPerSec;
+    double p50; // 微秒
+    double p90;
+    double p99;
+    double max;
+};
+
+const char* kHeader = "# name\tops_per_sec\tp50_us\tp90_us\tp99_us\tmax_us";
+
+Result summarize(const string& name, double seconds, vector<double>& latencies)
+{
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) { return latencies[static_cast<size_t>(p * (latencies.size() - 1))]; };
+    return {name, latencies.size() / seconds, percentile(0.5), percentile(0.9), percentile(0.99), latencies.back()};
+}
+
+// 执行 iterations 次 op 并统计，op 返回 false 时中止
+Result measure(const string& name, int iterations, const function<bool(int)>& op)
+{
+    vector<double> latencies;
+    latencies.reserve(iterations);
+    auto begin = chrono::steady_clock::now();
+    for (int i = 0; i != iterations; ++i)
+    {
+        auto start = chrono::steady_clock::now();
+        if (!op(i))
+        {
+            cerr << name << ": operation " << i << " failed." << endl;
+            exit(2);
+        }
+        latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    return summarize(name, seconds, latencies);
+}
+
+// numOfThreads 个线程同时执行，第 t 个线程执行 iterations 次 op(t, i)，每秒操作数按所有线程的总次数计算
+Result measureConcurrent(const string& name, int numOfThreads, int iterations, const function<bool(int, int)>& op)
+{
+    vector<vector<double>> latencies(numOfThreads);
+    auto begin = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t != numOfThreads; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            latencies[t].reserve(iterations);
+            for (int i = 0; i != iterations; ++i)
+            {
+                auto start = chrono::steady_clock::now();
+                if (!op(t, i))
+                {
+                    cerr << name << ": operation " << i << " on thread " << t << " failed." << endl;
+                    exit(2);
+                }
+                latencies[t].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+            }
+        });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    vector<double> merged;
+    for (const auto& l : latencies)
+    {
+        merged.insert(merged.end(), l.begin(), l.end());
+    }
+    return summarize(name, seconds, merged);
+}
+
+void print(ostream& os, const Result& r)
+{
+    os << r.name << '\t' << static_cast<long>(r.opsPerSec) << '\t' << r.p50 << '\t' << r.p90 << '\t' << r.p99 << '\t'
+       << r.max << '\n';
+}
+
+map<string, double> loadBaseline(const string& path)
+{
+    map<string, double> baseline;
+    ifstream is(path);
+    string line;
+    while (getline(is, line))
+    {
+        if (line.empty() || line[0] == '#') continue;
+        istringstream fields(line);
+        string name;
+        double opsPerSec;
+        if (fields >> name >> opsPerSec) baseline[name] = opsPerSec;
+    }
+    return baseline;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    string diskPath = "bench.disk";
+    string outputPath;
+    string baselinePath;
+    int iterations = 2000;
+    double tolerance = 0.2;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string option = argv[i];
+        if (option == "-d") diskPath = argv[i + 1];
+        else if (option == "-n") iterations = max(1, atoi(argv[i + 1]));
+        else if (option == "-o") outputPath = argv[i + 1];
+        else if (option == "-b") baselinePath = argv[i + 1];
+        else if (option == "-t") tolerance = atof(argv[i + 1]);
+        else
+        {
+            cerr << "Unknown option " << option << "." << endl;
+            return 2;
+        }
+    }
+
+    if (!Disk::CreateDisk(diskPath))
+    {
+        cerr << "Cannot create " << diskPath << "." << endl;
+        return 2;
+    }
+    vector<Result> results;
+    FileSystem::IoStats ioStats = {};
+    {
+        Disk disk(diskPath);
+        FileSystem fs(disk);
+        if (!fs.initFileSystem()) return 2;
+
+        // 按路径查找：不同深度的目录
+        fs.createDir("/a");
+        fs.createDir("/a/b");
+        fs.createDir("/a/b/c");
+        fs.createDir("/a/b/c/d");
+        const char* paths[] = {"/a", "/a/b", "/a/b/c", "/a/b/c/d"};
+        for (int depth = 1; depth <= 4; ++depth)
+        {
+            string path = paths[depth - 1];
+            results.push_back(measure("getEntry/depth" + to_string(depth), iterations,
+                                      [&fs, &path](int) { return fs.getEntry(path) != nullptr; }));
+        }
+
+        // 列目录：一个满的目录
+        for (int i = 0; i != FileSystem::kMaxChildEntries; ++i)
+        {
+            string name = "/a/b/c/d/f" + to_string(i);
+            fs.createFile(name, FileSystem::File);
+            fs.closeFile(name);
+        }
+        auto dir = fs.getEntry("/a/b/c/d");
+        results.push_back(measure("getChildren/8", iterations, [&dir](int) {
+            return dir->getChildren().size() == FileSystem::kMaxChildEntries;
+        }));
+
+        // 创建和删除
+        results.push_back(measure("createDelete", iterations, [&fs](int) {
+            return fs.createFile("/c", FileSystem::File) && fs.closeFile("/c") && fs.deleteEntry("/c");
+        }));
+
+        // 读写：磁盘只有 8 KiB，文件不超过 2 KiB
+        const int kFileSize = 2048;
+        vector<char> buffer(kFileSize, 'x');
+        mt19937 random(42);
+        for (int size : {16, 64, 512})
+        {
+            string suffix = "/" + to_string(size);
+
+            // 顺序追加，写满后删除重建（不计时间的部分很少）
+            fs.createFile("/w", FileSystem::File);
+            int written = 0;
+            results.push_back(measure("writeFile/seq" + suffix, iterations, [&](int) {
+                if (written + size > kFileSize)
+                {
+                    if (!fs.closeFile("/w") || !fs.deleteEntry("/w") || !fs.createFile("/w", FileSystem::File))
+                    {
+                        return false;
+                    }
+                    written = 0;
+                }
+                written += size;
+                return fs.writeFile("/w", buffer.data(), size);
+            }));
+            fs.closeFile("/w");
+            fs.deleteEntry("/w");
+
+            fs.createFile("/r", FileSystem::File);
+            fs.writeFile("/r", buffer.data(), kFileSize);
+            fs.closeFile("/r");
+
+            // 顺序读，读到文件尾后重新打开
+            int consumed = 0;
+            results.push_back(measure("readFile/seq" + suffix, iterations, [&](int) {
+                if (consumed + size > kFileSize)
+                {
+                    if (!fs.closeFile("/r")) return false;
+                    consumed = 0;
+                }
+                consumed += size;
+                return fs.readFile("/r", &buffer[0], size) == size;
+            }));
+            fs.closeFile("/r");
+
+            // 随机读写，描述符上的 readAt/writeAt 不移动读写指针
+            int fd = fs.open("/r", FileSystem::Read | FileSystem::Write);
+            uniform_int_distribution<int> offsets(0, kFileSize - size);
+            results.push_back(measure("readAt/rand" + suffix, iterations, [&](int) {
+                return fs.readAt(fd, offsets(random), &buffer[0], size) == size;
+            }));
+            results.push_back(measure("writeAt/rand" + suffix, iterations, [&](int) {
+                return fs.writeAt(fd, offsets(random), buffer.data(), size);
+            }));
+            fs.close(fd);
+            fs.deleteEntry("/r");
+        }
+
+        // 并发的扩展性：各线程读不同的文件，并在不同的目录下创建和删除文件，总次数不随线程数变化
+        fs.createDir("/p");
+        vector<int> fds;
+        for (int k = 0; k != 4; ++k)
+        {
+            string path = "/p/r" + to_string(k);
+            fs.createFile(path, FileSystem::File);
+            fs.writeFile(path, buffer.data(), 256);
+            fs.closeFile(path);
+            fds.push_back(fs.open(path, FileSystem::Read));
+        }
+        const char* dirs[] = {"/a", "/a/b", "/a/b/c"};
+        for (int numOfThreads : {1, 2, 4, 8})
+        {
+            results.push_back(measureConcurrent(
+                "concurrent/" + to_string(numOfThreads), numOfThreads, max(1, iterations / numOfThreads),
+                [&](int t, int i) {
+                    char buf[256];
+                    string path = dirs[t % 3] + string("/t") + to_string(t);
+                    return fs.readAt(fds[(t + i) % fds.size()], 0, buf, 256) == 256 &&
+                           fs.createFile(path, FileSystem::File) && fs.closeFile(path) && fs.deleteEntry(path);
+                }));
+        }
+        for (int fd : fds)
+        {
+            fs.close(fd);
+        }
+        ioStats = fs.ioStats();
+    }
+    remove(diskPath.c_str());
+
+    cout << kHeader << '\n';
+    for (const auto& r : results)
+    {
+        print(cout, r);
+    }
+    // 整个运行期间 I/O 调度器的合并情况，以注释行输出，不影响基线
+    cout << "# io_merge_rate\t" << (ioStats.requests > 0 ? 1 - double(ioStats.dispatches) / ioStats.requests : 0)
+         << "\tavg_queue_depth\t" << (ioStats.batches > 0 ? double(ioStats.requests) / ioStats.batches : 0) << '\n';
+    if (!outputPath.empty())
+    {
+        ofstream os(outputPath);
+        os << kHeader << '\n';
+        for (const auto& r : results)
+        {
+            print(os, r);
+        }
+    }
+
+    // 与基线比较
+    if (baselinePath.empty()) return 0;
+    auto baseline = loadBaseline(baselinePath);
+    int regressions = 0;
+    for (const auto& r : results)
+    {
+        auto iter = baseline.find(r.name);
+        if (iter == baseline.end() || iter->second <= 0) continue;
+        double ratio = r.opsPerSec / iter->second;
+        if (ratio < 1 - tolerance)
+        {
+            ++regressions;
+            cerr << "Regression: " << r.name << " at " << static_cast<int>(ratio * 100) << "% of baseline." << endl;
+        }
+    }
+    return regressions == 0 ? 0 : 1;
+}
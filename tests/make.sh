@@ -1,4 +1,11 @@
 #!/bin/bash
-g++ -I. -I.. -c -o filesystem.o ../filesystem.cc
-g++ -I. -I.. -c -o disk.o ../disk.cc
-g++ -I. -I.. -o testfilesystem testfilesystem.cc filesystem.o disk.o
+g++ -std=c++17 -I. -I.. -c -o filesystem.o ../filesystem.cc
+g++ -std=c++17 -I. -I.. -c -o disk.o ../disk.cc
+g++ -std=c++17 -I. -I.. -c -o filebuf.o ../filebuf.cc
+g++ -std=c++17 -I. -I.. -c -o compressor.o ../compressor.cc
+g++ -std=c++17 -I. -I.. -c -o crc32c.o ../crc32c.cc
+g++ -std=c++17 -I. -I.. -c -o executor.o ../executor.cc
+g++ -std=c++17 -I. -I.. -c -o iosched.o ../iosched.cc
+g++ -std=c++17 -I. -I.. -c -o trace.o ../trace.cc
+g++ -std=c++17 -I. -I.. -pthread -o testfilesystem testfilesystem.cc filesystem.o disk.o filebuf.o compressor.o crc32c.o executor.o iosched.o trace.o
+g++ -std=c++17 -I. -I.. -pthread -o benchfilesystem benchfilesystem.cc filesystem.o disk.o filebuf.o compressor.o crc32c.o executor.o iosched.o trace.o
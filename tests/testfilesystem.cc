@@ -1,9 +1,20 @@
+#include "crc32c.h"
 #include "disk.h"
+#include "filebuf.h"
 #include "filesystem.h"
+#include "trace.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdio>
+#include <future>
 #include <iostream>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
@@ -69,23 +80,27 @@ int main()
     assert(fs.getEntry(f5)->fullpath() == f5);
 
     // open and close
-    // five files was opened before
+    // all seven files was opened before, there is no longer a limit of five
     vector<string> openedFileList = fs.getOpenedFiles();
+    assert(openedFileList.size() == 7);
     assert(std::find(openedFileList.begin(), openedFileList.end(), f1) != openedFileList.end());
     assert(std::find(openedFileList.begin(), openedFileList.end(), f2) != openedFileList.end());
     assert(std::find(openedFileList.begin(), openedFileList.end(), f3) != openedFileList.end());
     assert(std::find(openedFileList.begin(), openedFileList.end(), f4) != openedFileList.end());
     assert(std::find(openedFileList.begin(), openedFileList.end(), f5) != openedFileList.end());
+    assert(std::find(openedFileList.begin(), openedFileList.end(), f6) != openedFileList.end());
+    assert(std::find(openedFileList.begin(), openedFileList.end(), f7) != openedFileList.end());
     assert((std::find(openedFileList.begin(), openedFileList.end(), "/f5") != openedFileList.end()) == false);
-    assert((std::find(openedFileList.begin(), openedFileList.end(), f6) != openedFileList.end()) == false);
-    assert(fs.openFile(f6, FileSystem::ReadOnly) == false);        // should not be able to open more file
     assert(fs.openFile(f1, FileSystem::Read | FileSystem::Write)); // reopen
     assert(fs.openFile(f5, FileSystem::Read | FileSystem::Write)); // reopen
+    assert(fs.getOpenedFiles().size() == 7);
     assert(fs.closeFile(f1));
     assert(fs.closeFile(f2));
     assert(fs.closeFile(f3));
     assert(fs.closeFile(f4));
     assert(fs.closeFile(f5));
+    assert(fs.closeFile(f6));
+    assert(fs.closeFile(f7));
     assert(fs.setFileAttributes(f6, (fs.getEntry(f6))->attributes() | FileSystem::ReadOnly));
     assert(fs.openFile(f6, FileSystem::Read | FileSystem::Write) == false); // 不能以写方式打开只读文件
     assert(fs.openFile(f6, FileSystem::Read));
@@ -113,15 +128,20 @@ int main()
     assert(fs.writeFile(f2, dataout, 1) == false); // 只读文件，不可写
     assert(fs.isOpened(f2) == false);              // 上个操作失败，文件不应处于打开状态
 
+    FileSystem::Stat st;
     assert(fs.writeFile(f3, dataout, 63)); // 写入 63 字节，总大小刚好不超过一个块
-    assert(fs.getEntry(f3)->size() == 64);
+    assert(fs.getEntry(f3)->size() == 63);
+    assert(fs.stat(f3, st) && st.size == 63 && st.numOfBlocks == 1);
     assert(fs.readFile(f3, datain, 32) == 32);
     assert(fs.readFile(f3, datain, 32) == 31); // 已读到文件尾
     assert(fs.readFile(f3, datain, 1) == 0);   // 已读到文件尾
     assert(fs.writeFile(f3, dataout, 1));      // 继续追加数据
-    assert(fs.getEntry(f3)->size() == 64 * 2); // 大小应为两个块大小
-    assert(fs.writeFile(f3, dataout, 64));     // 继续追加数据
-    assert(fs.getEntry(f3)->size() == 64 * 3); // 大小应为三个块大小
+    assert(fs.getEntry(f3)->size() == 64);     // 刚好一个块，不需要额外的结束标志
+    assert(fs.stat(f3, st) && st.numOfBlocks == 1);
+    assert(fs.writeFile(f3, dataout, 64)); // 继续追加数据
+    assert(fs.getEntry(f3)->size() == 64 * 2);
+    assert(fs.stat(f3, st) && st.size == 64 * 2 && st.numOfBlocks == 2); // 大小应为两个块大小
+    assert(fs.stat("/f", st) == false);
     assert(fs.closeFile(f3));
     assert(fs.readFile(f3, datain, 64 * 2) == 64 * 2); // 关闭文件后重新读取（重置读取指针）
     assert(fs.readFile(f3, datain, 1) == 0);           // 已读到文件尾
@@ -134,6 +154,981 @@ int main()
     assert(fs.readFile(f4, dataout, 1) == false); // 不能读取不以读方式打开的文件
     assert(fs.closeFile(f4));
 
+    // 文件可以包含任意二进制数据
+    const char binary[] = {'a', '#', 'b', '\0', '$', 'c'};
+    assert(fs.writeFile(f5, binary, sizeof(binary)));
+    assert(fs.closeFile(f5));
+    assert(fs.readFile(f5, datain, 64) == sizeof(binary));
+    assert(std::equal(binary, binary + sizeof(binary), datain));
+    assert(fs.closeFile(f5));
+
+    // file descriptor
+    int fd3 = fs.open(f3, FileSystem::Read | FileSystem::Write);
+    assert(fd3 >= 0);
+    assert(fs.isOpened(f3));
+    assert(fs.open(f3, FileSystem::Read) == fd3); // 已经打开，返回同一描述符
+    assert(fs.read(fd3, datain, 64 * 3) == 64 * 2);
+    assert(fs.write(fd3, dataout, 10)); // 追加数据
+    assert(fs.read(fd3, datain, 64) == 10);
+    assert(fs.close(fd3));
+    assert(fs.isOpened(f3)); // 还有一个引用
+    assert(fs.close(fd3));
+    assert(fs.close(fd3) == false); // 已经关闭
+    assert(fs.isOpened(f3) == false);
+    assert(fs.read(-1, datain, 1) == 0);
+
+    // random access
+    int fd7 = fs.open(f7, FileSystem::Read | FileSystem::Write);
+    assert(fd7 >= 0);
+    assert(fs.writeAt(fd7, 0, dataout, 100));
+    assert(fs.writeAt(fd7, 10, "abc", 3)); // 原地覆盖
+    assert(fs.stat(f7, st) && st.size == 100 && st.numOfBlocks == 2);
+    assert(fs.readAt(fd7, 9, datain, 5) == 5);
+    assert(string(datain, datain + 5) == "XabcX");
+    assert(fs.writeAt(fd7, 130, "z", 1)); // 写到文件尾之后，中间填零
+    assert(fs.stat(f7, st) && st.size == 131 && st.numOfBlocks == 3);
+    assert(fs.readAt(fd7, 100, datain, 64) == 31);
+    assert(std::all_of(datain, datain + 30, [](char c) { return c == 0; }) && datain[30] == 'z');
+    assert(fs.readAt(fd7, 200, datain, 1) == 0);
+    assert(fs.writeAt(fd7, 60, "0123456789", 10)); // 跨块覆盖
+    assert(fs.readAt(fd7, 58, datain, 14) == 14);
+    assert(string(datain, datain + 14) == string("XX0123456789XX"));
+    assert(fs.read(fd7, datain, 1) == 1 && datain[0] == 'X'); // 读指针不受影响
+    {
+        vector<thread> threads;
+        for (int t = 0; t != 4; ++t)
+        {
+            threads.emplace_back([&fs, fd7]() {
+                char buf[5];
+                for (int i = 0; i != 100; ++i)
+                {
+                    assert(fs.readAt(fd7, 9, buf, 5) == 5);
+                    assert(string(buf, buf + 5) == "XabcX");
+                }
+            });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+    }
+    assert(fs.close(fd7));
+
+    // scatter/gather
+    {
+        assert(fs.createFile("/d1/v", FileSystem::File));
+        int fd = fs.open("/d1/v", FileSystem::Read | FileSystem::Write);
+        char header[] = "HEAD";
+        char trailer[] = "TAIL";
+        FileSystem::IoVec out[] = {{header, 4}, {dataout, 120}, {trailer, 4}};
+        assert(fs.writev(fd, out, 3));
+        assert(fs.stat("/d1/v", st) && st.size == 128 && st.numOfBlocks == 2);
+        char in1[2], in2[100], in3[40];
+        FileSystem::IoVec in[] = {{in1, 2}, {in2, 100}, {in3, 40}};
+        assert(fs.readv(fd, in, 3) == 128);
+        assert(string(in1, in1 + 2) == "HE");
+        assert(string(in2, in2 + 2) == "AD" && in2[2] == 'X' && in2[99] == 'X');
+        assert(string(in3 + 22, in3 + 26) == "TAIL");
+        assert(fs.close(fd));
+        assert(fs.closeFile("/d1/v")); // 创建文件时打开的
+        assert(fs.deleteEntry("/d1/v"));
+    }
+
+    // sparse file
+    {
+        assert(fs.createFile("/d1/h", FileSystem::File));
+        int fd = fs.open("/d1/h", FileSystem::Read | FileSystem::Write);
+        assert(fs.writeAt(fd, 1000, "end", 3)); // 前面是空洞，不分配块
+        assert(fs.stat("/d1/h", st) && st.size == 1003 && st.numOfBlocks == 1);
+        assert(fs.readAt(fd, 0, datain, 1024) == 1003);
+        assert(std::all_of(datain, datain + 1000, [](char c) { return c == 0; }));
+        assert(string(datain + 1000, datain + 1003) == "end");
+        assert(fs.writeAt(fd, 500, "mid", 3)); // 填充空洞中的一块
+        assert(fs.stat("/d1/h", st) && st.size == 1003 && st.numOfBlocks == 2);
+        assert(fs.readAt(fd, 0, datain, 1024) == 1003);
+        assert(std::all_of(datain, datain + 500, [](char c) { return c == 0; }));
+        assert(string(datain + 500, datain + 503) == "mid");
+        assert(std::all_of(datain + 503, datain + 1000, [](char c) { return c == 0; }));
+        assert(string(datain + 1000, datain + 1003) == "end");
+        assert(fs.close(fd));
+        assert(fs.closeFile("/d1/h"));
+        assert(fs.readFile("/d1/h", datain, 1024) == 1003); // 重新打开后块链依然正确
+        assert(string(datain + 500, datain + 503) == "mid");
+        assert(fs.closeFile("/d1/h"));
+        assert(fs.deleteEntry("/d1/h"));
+    }
+
+    // 内嵌在目录项中的小文件
+    {
+        assert(fs.createFile("/d1/i", FileSystem::File));
+        assert(fs.stat("/d1/i", st) && st.size == 0 && st.numOfBlocks == 0); // 新文件不分配块
+        assert(fs.writeFile("/d1/i", "ab", 2));
+        assert(fs.writeFile("/d1/i", "c", 1));
+        assert(fs.closeFile("/d1/i"));
+        assert(fs.stat("/d1/i", st) && st.size == 3 && st.numOfBlocks == 0);
+        assert(*fs.readFile("/d1/i", 10) == "abc"); // 重新打开后从目录项读出
+        assert(fs.closeFile("/d1/i"));
+        assert(fs.clone("/d1/i", "/d1/j"));
+        assert(fs.writeFile("/d1/i", "defg", 4)); // 超出目录项的容量，迁移到块中
+        assert(fs.closeFile("/d1/i"));
+        assert(fs.stat("/d1/i", st) && st.size == 7 && st.numOfBlocks == 1);
+        assert(*fs.readFile("/d1/i", 10) == "abcdefg");
+        assert(fs.closeFile("/d1/i"));
+        assert(*fs.readFile("/d1/j", 10) == "abc");
+        assert(fs.closeFile("/d1/j"));
+        assert(fs.setFileAttributes("/d1/j", FileSystem::File | FileSystem::System));
+        assert(*fs.readFile("/d1/j", 10) == "abc"); // 修改属性不影响内嵌的数据
+        assert(fs.closeFile("/d1/j"));
+        assert(fs.deleteEntry("/d1/i"));
+        assert(fs.deleteEntry("/d1/j"));
+    }
+
+    // 写时复制克隆
+    {
+        assert(fs.createFile("/d1/c", FileSystem::File));
+        assert(fs.writeFile("/d1/c", dataout, 300));
+        assert(fs.closeFile("/d1/c"));
+        assert(fs.clone("/d1/c", "/d1/k"));
+        assert(fs.clone("/d1/c", "/d1/k") == false); // 目标已存在
+        assert(fs.clone("/d1", "/d1/e") == false);   // 不能克隆目录
+        assert(fs.stat("/d1/k", st) && st.size == 300 && st.numOfBlocks == 5);
+        assert(fs.readFile("/d1/k", datain, 1024) == 300);
+        assert(std::equal(datain, datain + 300, dataout));
+        assert(fs.closeFile("/d1/k"));
+        int fd = fs.open("/d1/k", FileSystem::Write);
+        assert(fs.writeAt(fd, 130, "cow", 3)); // 复制前三块，其余块仍然共享
+        assert(fs.close(fd));
+        assert(fs.readFile("/d1/c", datain, 1024) == 300); // 源文件不变
+        assert(std::equal(datain, datain + 300, dataout));
+        assert(fs.closeFile("/d1/c"));
+        assert(fs.deleteEntry("/d1/c")); // 共享的块还被克隆引用
+        assert(fs.readFile("/d1/k", datain, 1024) == 300);
+        assert(string(datain + 130, datain + 133) == "cow");
+        assert(std::equal(datain + 133, datain + 300, dataout + 133));
+        assert(fs.closeFile("/d1/k"));
+        assert(fs.deleteEntry("/d1/k"));
+    }
+
+    // 克隆次数受引用计数表项的上限限制，达到上限后克隆失败而不是溢出
+    {
+        assert(Disk::CreateDisk("clone.disk"));
+        Disk kd("clone.disk");
+        {
+            FileSystem kfs(kd);
+            assert(kfs.initFileSystem());
+            assert(kfs.createFile("/s", FileSystem::File));
+            assert(kfs.writeFile("/s", dataout, 100));
+            assert(kfs.closeFile("/s"));
+            vector<string> clones;
+            const int n = FileSystem::kMaxChildEntries;
+            for (int i = 0; i != FileSystem::kMaxRefCount - 1; ++i) // 源文件的目录项占一个引用
+            {
+                // 每个目录只有 8 个目录项，克隆分散到两层目录中
+                string top = "/c" + to_string(i / (n * n));
+                string dir = top + "/" + to_string(i / n % n);
+                if (i % (n * n) == 0) assert(kfs.createDir(top));
+                if (i % n == 0) assert(kfs.createDir(dir));
+                clones.push_back(dir + "/k" + to_string(i % n));
+                assert(kfs.clone("/s", clones.back()));
+            }
+            assert(kfs.createDir("/e"));
+            assert(kfs.clone("/s", "/e/k") == false); // 已达上限
+            assert(kfs.deleteEntry(clones.back()));
+            assert(kfs.clone("/s", "/e/k")); // 释放一个引用后又可以克隆
+            clones.back() = "/e/k";
+
+            for (const auto& path : clones)
+            {
+                assert(kfs.deleteEntry(path));
+            }
+            assert(kfs.readFile("/s", datain, 1024) == 100 && std::equal(datain, datain + 100, dataout));
+            assert(kfs.closeFile("/s"));
+            FileSystem::FsckReport report;
+            assert(kfs.fsck(report, false) && report.files == 1);
+        }
+        remove("clone.disk");
+    }
+
+    // 压缩文件
+    {
+        assert(fs.createFile("/d1/z", FileSystem::File | FileSystem::Compressed));
+        assert(fs.closeFile("/d1/z"));
+        string text;
+        while (text.size() < 1000)
+        {
+            text += "the quick brown fox jumps over the lazy dog. ";
+        }
+        text.resize(1000);
+        assert(fs.writeFile("/d1/z", text.data(), 1000));
+        assert(fs.closeFile("/d1/z"));
+        assert(fs.stat("/d1/z", st) && st.size == 1000 && st.numOfBlocks < 16 && st.compressionRatio > 1);
+        assert(fs.createFile("/d1/u", FileSystem::File));
+        assert(fs.writeFile("/d1/u", "abcdef", 6)); // 最后一块不满，但没有压缩
+        assert(fs.closeFile("/d1/u"));
+        assert(fs.stat("/d1/u", st) && st.numOfBlocks == 1 && st.compressionRatio == 1);
+        assert(fs.deleteEntry("/d1/u"));
+        assert(*fs.readFile("/d1/z", 1024) == text);
+        assert(fs.closeFile("/d1/z"));
+        FileSystem::CacheStats before = fs.decompressionCacheStats();
+        assert(*fs.readFile("/d1/z", 1024) == text); // 从解压缓存读出
+        assert(fs.closeFile("/d1/z"));
+        assert(fs.decompressionCacheStats().hits > before.hits);
+
+        int fd = fs.open("/d1/z", FileSystem::Read | FileSystem::Write);
+        char noise[300]; // 不可压缩的数据按原样存储
+        for (int i = 0; i != 300; ++i)
+        {
+            noise[i] = static_cast<char>((i * 7919 + i * i * 31) >> 3);
+        }
+        assert(fs.writeAt(fd, 500, noise, 300));
+        text.replace(500, 300, noise, 300);
+        assert(fs.writeAt(fd, 1500, "end", 3)); // 中间的单元成为空洞
+        text += string(500, '\0') + "end";
+        assert(*fs.readFile("/d1/z", 2048) == text);
+        assert(fs.close(fd));
+        assert(fs.setFileAttributes("/d1/z", FileSystem::File) == false); // 非空文件不能取消压缩
+        assert(fs.deleteEntry("/d1/z"));
+    }
+
+    // 块校验和
+    {
+        assert(toyfs::crc32c("123456789", 9) == 0xe3069283);
+        assert(fs.createFile("/d1/q", FileSystem::File));
+        assert(fs.writeFile("/d1/q", string(64, 'Q').data(), 64));
+        assert(fs.closeFile("/d1/q"));
+        // 找到文件的数据块，绕过文件系统直接破坏它
+        int sector = 0;
+        for (; sector != Disk::kNumOfSector; ++sector)
+        {
+            assert(d.read(datain, sector));
+            if (string(datain, datain + 64) == string(64, 'Q')) break;
+        }
+        assert(sector != Disk::kNumOfSector);
+        datain[10] = 'R';
+        assert(d.write(datain, sector));
+        long failures = fs.checksumStats().failures;
+        assert(fs.readFile("/d1/q", datain, 64) == 0); // 校验失败
+        assert(fs.closeFile("/d1/q"));
+        assert(fs.checksumStats().failures == failures + 1);
+        fs.setChecksumVerification(false);
+        assert(fs.readFile("/d1/q", datain, 64) == 64 && datain[10] == 'R');
+        assert(fs.closeFile("/d1/q"));
+        fs.setChecksumVerification(true);
+        assert(fs.deleteEntry("/d1/q"));
+    }
+
+    // iostream
+    {
+        assert(fs.createFile("/d1/s", FileSystem::File));
+        assert(fs.closeFile("/d1/s"));
+        toyfs::filebuf fb;
+        assert(fb.open(fs, "/d1/s", std::ios_base::in | std::ios_base::out, 1) == &fb);
+        std::ostream os(&fb);
+        std::istream is(&fb);
+        os << "hello " << 42 << '\n';
+        os.write(dataout, 200); // 大块数据直接写入
+        assert(os.good());
+        assert(is.seekg(0).good());
+        string word;
+        int number;
+        is >> word >> number;
+        assert(word == "hello" && number == 42);
+        is.get();
+        is.read(datain, 200);
+        assert(is.gcount() == 200 && std::all_of(datain, datain + 200, [](char c) { return c == 'X'; }));
+        assert(is.get() == std::char_traits<char>::eof()); // 已读到文件尾
+        is.clear();
+        assert(is.seekg(0, std::ios_base::end).tellg() == 209);
+        assert(os.seekp(6).good());
+        os << "77";
+        os.flush();
+        assert(fs.readAt(fs.open("/d1/s", FileSystem::Read), 0, datain, 9) == 9);
+        assert(fs.closeFile("/d1/s"));
+        assert(string(datain, datain + 9) == "hello 77\n");
+        assert(fb.close() == &fb);
+        assert(fs.isOpened("/d1/s") == false);
+        assert(*fs.readFile("/d1/s", 5) == "hello");
+        assert(fs.closeFile("/d1/s"));
+        assert(fs.deleteEntry("/d1/s"));
+    }
+
+    // 多线程并发打开和关闭
+    {
+        vector<thread> threads;
+        for (int t = 0; t != 8; ++t)
+        {
+            threads.emplace_back([&fs, &f3, &f5]() {
+                for (int i = 0; i != 100; ++i)
+                {
+                    const string& path = (i % 2 == 0) ? f3 : f5;
+                    int fd = fs.open(path, FileSystem::Read);
+                    assert(fd >= 0);
+                    assert(fs.isOpened(path));
+                    fs.getOpenedFiles();
+                    assert(fs.close(fd));
+                }
+            });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        assert(fs.getOpenedFiles().empty());
+    }
+
+    // 多线程并发读写：读不同的文件、读同一个文件、在不同目录下创建和写入文件，各线程看到的内容都正确
+    // 吞吐量的扩展性由 benchfilesystem 测量
+    {
+        const vector<string> paths = {f3, f5, f7};
+        vector<int> fds;
+        vector<string> contents;
+        for (const auto& path : paths)
+        {
+            int fd = fs.open(path, FileSystem::Read);
+            assert(fd >= 0);
+            int n = fs.readAt(fd, 0, datain, 1024);
+            assert(n > 0);
+            fds.push_back(fd);
+            contents.push_back(string(datain, datain + n));
+        }
+        const vector<string> dirs = {d2, d3, d4};
+        for (int numOfThreads : {1, 2, 4, 8})
+        {
+            const int rounds = 20;
+            FileSystem::CommitStats commitsBefore = fs.commitStats();
+            vector<thread> threads;
+            for (int t = 0; t != numOfThreads; ++t)
+            {
+                threads.emplace_back([&, t]() {
+                    char buf[256];
+                    string path = dirs[t % dirs.size()] + "/t" + to_string(t);
+                    for (int i = 0; i != rounds; ++i)
+                    {
+                        int k = (t + i) % fds.size(); // 不同的文件
+                        int n = contents[k].size();
+                        assert(fs.readAt(fds[k], 0, buf, n) == n);
+                        assert(string(buf, buf + n) == contents[k]);
+                        assert(fs.readAt(fds[0], 1, buf, 8) == 8); // 同一个文件
+                        assert(string(buf, buf + 8) == contents[0].substr(1, 8));
+                        string data = string(70, static_cast<char>('a' + t)) + to_string(i); // 跨两块，各线程不同
+                        assert(fs.createFile(path, FileSystem::File));
+                        assert(fs.writeFile(path, data.data(), static_cast<int>(data.size())));
+                        assert(fs.closeFile(path));
+                        assert(fs.readFile(path, buf, 256) == static_cast<int>(data.size()));
+                        assert(string(buf, buf + data.size()) == data);
+                        assert(fs.closeFile(path));
+                        assert(fs.deleteEntry(path));
+                    }
+                });
+            }
+            for (auto& t : threads)
+            {
+                t.join();
+            }
+            assert(fs.commitStats().syncs - commitsBefore.syncs >= numOfThreads * rounds * 2); // 每次创建和删除至少一次
+        }
+        for (const auto& dir : dirs)
+        {
+            assert(fs.getEntry(dir)->getChildren().empty());
+        }
+        for (int fd : fds)
+        {
+            assert(fs.close(fd));
+        }
+        assert(fs.getOpenedFiles().empty());
+    }
+
+    // 组提交：同时开始的 sync 合并写回
+    // 每次 sync 前先覆盖各自文件的一块，写回校验和表时调度器等待延迟预算，其他线程的 sync 在此期间到达
+    {
+        const int numOfThreads = 8;
+        const int rounds = 10;
+        const vector<string> dirs = {d2, d3, d4};
+        vector<string> paths;
+        vector<int> fds;
+        for (int t = 0; t != numOfThreads; ++t)
+        {
+            paths.push_back(dirs[t % dirs.size()] + "/g" + to_string(t));
+            assert(fs.createFile(paths[t], FileSystem::File));
+            assert(fs.writeFile(paths[t], dataout, 64));
+            assert(fs.closeFile(paths[t]));
+            fds.push_back(fs.open(paths[t], FileSystem::Write));
+        }
+        fs.setIoLatencyBudget(2000);
+        FileSystem::CommitStats before = fs.commitStats();
+        atomic<int> arrived(0);
+        vector<thread> threads;
+        for (int t = 0; t != numOfThreads; ++t)
+        {
+            threads.emplace_back([&, t]() {
+                ++arrived;
+                while (arrived < numOfThreads) // 所有线程都就绪后一起开始
+                {
+                    this_thread::yield();
+                }
+                for (int i = 0; i != rounds; ++i)
+                {
+                    assert(fs.writeAt(fds[t], 0, "s", 1));
+                    assert(fs.sync());
+                }
+            });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        FileSystem::CommitStats after = fs.commitStats();
+        fs.setIoLatencyBudget(0);
+        assert(after.syncs - before.syncs >= numOfThreads * rounds);
+        assert(after.flushes - before.flushes < after.syncs - before.syncs); // 有 sync 与其他线程共享了一次写回
+        for (int t = 0; t != numOfThreads; ++t)
+        {
+            assert(fs.close(fds[t]));
+            assert(fs.deleteEntry(paths[t]));
+        }
+    }
+
+    // 异步接口
+    {
+        auto created = fs.asyncCreate("/d2/a", FileSystem::File);
+        assert(created.get());
+        assert(fs.asyncCreate("/d2/a", FileSystem::File).get() == false); // 已存在
+        assert(fs.closeFile("/d2/a"));
+        int fd = fs.open("/d2/a", FileSystem::Read | FileSystem::Write);
+        assert(fd >= 0);
+        vector<future<bool>> writes;
+        for (int i = 0; i != 8; ++i)
+        {
+            writes.push_back(fs.asyncWrite(fd, 64 * i, dataout, 64));
+        }
+        for (auto& w : writes)
+        {
+            assert(w.get());
+        }
+        vector<future<int>> reads;
+        for (int i = 0; i != 8; ++i)
+        {
+            reads.push_back(fs.asyncRead(fd, 64 * i, datain + 64 * i, 64));
+        }
+        for (auto& r : reads)
+        {
+            assert(r.get() == 64);
+        }
+        assert(std::equal(datain, datain + 64 * 8, dataout));
+        assert(fs.asyncGetEntry("/d2/a").get()->size() == 64 * 8);
+        assert(fs.asyncGetEntry("/d2/b").get() == nullptr);
+        assert(fs.close(fd));
+        assert(fs.deleteEntry("/d2/a"));
+    }
+
+    // 只读快照
+    {
+        assert(fs.createFile("/d2/s", FileSystem::File));
+        assert(fs.writeFile("/d2/s", dataout, 200));
+        assert(fs.closeFile("/d2/s"));
+        assert(fs.createFile("/d2/i", FileSystem::File));
+        assert(fs.writeFile("/d2/i", "ab", 2)); // 内嵌文件
+        assert(fs.closeFile("/d2/i"));
+        auto snap = fs.snapshot();
+        assert(snap != nullptr);
+        int fd = fs.open("/d2/s", FileSystem::Write);
+        assert(fs.writeAt(fd, 100, "new", 3)); // 复制被快照共享的块
+        assert(fs.write(fd, "tail", 4));
+        assert(fs.close(fd));
+        assert(fs.writeFile("/d2/i", "c", 1));
+        assert(fs.closeFile("/d2/i"));
+        assert(fs.createFile("/d2/t", FileSystem::File));
+        assert(fs.closeFile("/d2/t"));
+        // 快照之后的修改对快照不可见
+        assert(snap->exist("/d2/s") && snap->exist("/d2/i") && !snap->exist("/d2/t"));
+        assert(snap->getEntry("/d2/s")->size() == 200 && snap->getEntry("/d2/s")->fullpath() == "/d2/s");
+        assert(snap->readAt("/d2/s", 0, datain, 1024) == 200);
+        assert(std::equal(datain, datain + 200, dataout));
+        assert(snap->readAt("/d2/i", 0, datain, 10) == 2 && string(datain, datain + 2) == "ab");
+        assert(fs.readFile("/d2/s", datain, 1024) == 204);
+        assert(string(datain + 100, datain + 103) == "new" && string(datain + 200, datain + 204) == "tail");
+        assert(fs.closeFile("/d2/s"));
+        assert(*fs.readFile("/d2/i", 10) == "abc");
+        assert(fs.closeFile("/d2/i"));
+        assert(fs.deleteEntry("/d2/s")); // 快照中的块还被引用
+        assert(snap->readAt("/d2/s", 150, datain, 1024) == 50);
+        assert(std::equal(datain, datain + 50, dataout + 150));
+        assert(snap->readAt("/d2", 0, datain, 10) == 0); // 不能读取目录
+        FileSystem::FsckReport report;
+        assert(fs.fsck(report, true)); // 只被快照引用的块仍在使用，不是泄漏的块，修复时不能回收
+        assert(report.leakedBlocks == 0 && report.refCountErrors == 0 && report.repaired == false);
+        assert(snap->readAt("/d2/s", 0, datain, 1024) == 200 && std::equal(datain, datain + 200, dataout));
+        snap.reset(); // 释放快照，只属于它的块被回收
+        assert(fs.deleteEntry("/d2/i"));
+        assert(fs.deleteEntry("/d2/t"));
+    }
+
+    // 快照存在时崩溃：快照的引用不写入磁盘，挂载时回收只被快照引用的块
+    {
+        assert(Disk::CreateDisk("snap.disk"));
+        assert(Disk::CreateDisk("crash.disk"));
+        {
+            Disk sd("snap.disk");
+            Disk crashed("crash.disk");
+            FileSystem sfs(sd);
+            assert(sfs.initFileSystem());
+            assert(sfs.createFile("/a", FileSystem::File));
+            assert(sfs.writeFile("/a", dataout, 200));
+            assert(sfs.closeFile("/a"));
+            assert(sfs.createFile("/b", FileSystem::File));
+            assert(sfs.writeFile("/b", dataout, 100));
+            assert(sfs.closeFile("/b"));
+            auto snap = sfs.snapshot();
+            assert(sfs.deleteEntry("/a")); // 块只被快照引用
+            assert(sfs.sync());
+            char block[Disk::kSectorSize];
+            for (int sector = 0; sector != Disk::kNumOfSector; ++sector) // 复制此时的磁盘，相当于崩溃
+            {
+                assert(sd.read(block, sector));
+                assert(crashed.write(block, sector));
+            }
+            {
+                FileSystem cfs(crashed);
+                FileSystem::FsckReport report;
+                assert(cfs.fsck(report, false) && report.refCountErrors == 0 && report.leakedBlocks == 0);
+                assert(!cfs.exist("/a"));
+                assert(cfs.readFile("/b", datain, 1024) == 100 && std::equal(datain, datain + 100, dataout));
+                assert(cfs.closeFile("/b"));
+            }
+            assert(snap->readAt("/a", 0, datain, 1024) == 200 && std::equal(datain, datain + 200, dataout));
+            snap.reset();
+            FileSystem::FsckReport report;
+            assert(sfs.fsck(report, false) && report.files == 1);
+        }
+        remove("snap.disk");
+        remove("crash.disk");
+    }
+
+    // 事务
+    {
+        auto records = fs.journalStats().records;
+        auto txn = fs.beginTransaction();
+        txn->createDir("/d2/t");
+        txn->createFile("/d2/t/a", FileSystem::File);
+        txn->createFile("/d2/t/b", FileSystem::File);
+        txn->writeFile("/d2/t/a", dataout, 100);
+        txn->writeFile("/d2/t/a", dataout + 100, 50); // 追加
+        txn->writeFile("/d2/t/b", "xy", 2);
+        txn->setFileAttributes("/d2/t/b", FileSystem::File | FileSystem::ReadOnly);
+        assert(fs.exist("/d2/t") == false); // 提交之前不生效
+        assert(txn->commit());
+        assert(fs.journalStats().records == records + 1); // 作为一条日志记录提交，只刷新一次磁盘
+        assert(fs.readFile("/d2/t/a", datain, 1024) == 150 && std::equal(datain, datain + 150, dataout));
+        assert(fs.closeFile("/d2/t/a"));
+        assert(*fs.readFile("/d2/t/b", 10) == "xy" && fs.getEntry("/d2/t/b")->isReadOnly());
+        assert(fs.closeFile("/d2/t/b"));
+
+        // 任一操作失败时所有操作都不生效
+        txn->writeFile("/d2/t/a", "more", 4);
+        txn->deleteEntry("/d2/t/b");
+        txn->createDir("/d2/u");
+        txn->createFile("/d2/v/c", FileSystem::File); // 父目录不存在
+        assert(txn->commit() == false);
+        assert(fs.getEntry("/d2/t/a")->size() == 150 && fs.exist("/d2/t/b") && !fs.exist("/d2/u"));
+        assert(fs.readFile("/d2/t/a", datain, 1024) == 150 && std::equal(datain, datain + 150, dataout));
+        txn->writeFile("/d2/t/a", "more", 4); // 不能修改已打开的文件
+        assert(txn->commit() == false);
+        assert(fs.closeFile("/d2/t/a"));
+
+        txn->deleteEntry("/d2/t/a");
+        txn->setFileAttributes("/d2/t/b", FileSystem::File);
+        txn->deleteEntry("/d2/t/b");
+        txn->deleteEntry("/d2/t");
+        assert(txn->commit());
+        assert(fs.exist("/d2/t") == false);
+    }
+
+    // 事务撤销后压缩文件不变：事务中改写的单元写到新分配的块上
+    {
+        assert(Disk::CreateDisk("txn.disk"));
+        Disk td("txn.disk");
+        string text;
+        while (text.size() < 100)
+        {
+            text += "the quick brown fox jumps over the lazy dog. ";
+        }
+        text.resize(100);
+        char noise[150]; // 追加后整个单元不可压缩，按原样存储，占用的块数与原来不同
+        for (int i = 0; i != 150; ++i)
+        {
+            noise[i] = static_cast<char>((i * 7919 + i * i * 31) >> 3);
+        }
+        {
+            FileSystem tfs(td);
+            assert(tfs.initFileSystem());
+            assert(tfs.createFile("/z", FileSystem::File | FileSystem::Compressed));
+            assert(tfs.writeFile("/z", text.data(), 100));
+            assert(tfs.closeFile("/z"));
+            auto txn = tfs.beginTransaction();
+            txn->writeFile("/z", noise, 150); // 追加，重写最后一个单元
+            txn->deleteEntry("/none");        // 失败
+            assert(txn->commit() == false);
+            assert(*tfs.readFile("/z", 1024) == text);
+            assert(tfs.closeFile("/z"));
+
+            // 事务中删除的文件的块不能再分配给同一事务中写入的文件，否则撤销后原来的文件读出新写入的数据
+            assert(tfs.createFile("/x", FileSystem::File));
+            assert(tfs.writeFile("/x", string(300, 'A').data(), 300));
+            assert(tfs.closeFile("/x"));
+            txn = tfs.beginTransaction();
+            txn->deleteEntry("/x");
+            txn->createFile("/y", FileSystem::File);
+            txn->writeFile("/y", string(300, 'B').data(), 300);
+            txn->deleteEntry("/none"); // 失败
+            assert(txn->commit() == false);
+            assert(*tfs.readFile("/x", 1024) == string(300, 'A') && !tfs.exist("/y"));
+            assert(tfs.closeFile("/x"));
+            assert(tfs.deleteEntry("/x"));
+        }
+        {
+            FileSystem tfs(td);
+            assert(*tfs.readFile("/z", 1024) == text);
+            assert(tfs.closeFile("/z"));
+            auto txn = tfs.beginTransaction();
+            txn->writeFile("/z", noise, 150);
+            assert(txn->commit());
+            text.append(noise, 150);
+            assert(*tfs.readFile("/z", 1024) == text);
+            assert(tfs.closeFile("/z"));
+            FileSystem::FsckReport report;
+            assert(tfs.fsck(report, false)); // 单元原有的块已经回收
+            assert(report.leakedBlocks == 0 && report.refCountErrors == 0 && report.brokenChains == 0);
+        }
+        {
+            FileSystem tfs(td);
+            assert(*tfs.readFile("/z", 1024) == text);
+            assert(tfs.closeFile("/z"));
+        }
+        remove("txn.disk");
+    }
+
+    // I/O 调度器合并并发的请求
+    {
+        FileSystem::IoStats before = fs.ioStats();
+        assert(before.requests > 0 && before.dispatches <= before.requests);
+        assert(before.maxQueueDepth >= 1);
+
+        int fd = fs.open(f3, FileSystem::Read);
+        assert(fd >= 0);
+        string expected(datain, datain + fs.readAt(fd, 0, datain, 128));
+        fs.setIoLatencyBudget(2000); // 等待其他线程的请求，以便合并
+        vector<thread> threads;
+        for (int t = 0; t != 8; ++t)
+        {
+            threads.emplace_back([&fs, fd, &expected]() {
+                char buf[128];
+                for (int i = 0; i != 10; ++i)
+                {
+                    assert(fs.readAt(fd, 0, buf, 128) == 128);
+                    assert(string(buf, buf + 128) == expected);
+                }
+            });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        fs.setIoLatencyBudget(0);
+        assert(fs.close(fd));
+
+        FileSystem::IoStats after = fs.ioStats();
+        assert(after.requests - before.requests >= 8 * 10 * 2);
+        assert(after.dispatches - before.dispatches < after.requests - before.requests); // 有请求被合并
+        assert(after.maxQueueDepth > 1);
+    }
+
+    // 元数据日志：崩溃后挂载时重放
+    {
+        assert(Disk::CreateDisk("journal.disk"));
+        Disk jd("journal.disk");
+        {
+            FileSystem jfs(jd);
+            assert(jfs.initFileSystem());
+            while (jfs.journalStats().checkpoints == 0) // 初始化后日志用过一半，等待后台检查点
+            {
+                this_thread::yield();
+            }
+            assert(jfs.createDir("/a"));
+            assert(jfs.createFile("/a/b", FileSystem::File));
+            assert(jfs.closeFile("/a/b"));
+            FileSystem::JournalStats js = jfs.journalStats();
+            assert(js.records == 3 && js.checkpoints == 1 && js.replayed == 0);
+        }
+        // 模拟崩溃：日志记录已经持久化，但根目录块还没有写回原位置
+        char block[Disk::kSectorSize];
+        int sector = 0;
+        for (; sector != Disk::kNumOfSector; ++sector)
+        {
+            assert(jd.read(block, sector));
+            if (block[0] == 'a' && block[1] == '$') break;
+        }
+        assert(sector != Disk::kNumOfSector);
+        std::fill(block, block + Disk::kSectorSize, '$');
+        assert(jd.write(block, sector));
+        {
+            FileSystem jfs(jd);
+            assert(jfs.journalStats().replayed == 2);
+            assert(jfs.exist("/a/b"));
+            assert(jfs.checksumStats().failures == 0);
+        }
+        {
+            FileSystem jfs(jd); // 重放后日志已清空
+            assert(jfs.journalStats().replayed == 0);
+            assert(jfs.exist("/a/b"));
+        }
+        remove("journal.disk");
+    }
+
+    // 事务中分配块时触发检查点：清空日志之前原位置的写入必须持久化，不能像 sync 那样在事务中跳过
+    {
+        assert(Disk::CreateDisk("journal.disk"));
+        Disk jd("journal.disk");
+        {
+            FileSystem jfs(jd);
+            assert(jfs.initFileSystem());
+            assert(jfs.createDir("/a"));
+            assert(jfs.createFile("/a/f", FileSystem::File));
+            assert(jfs.closeFile("/a/f"));
+            while (jfs.journalStats().checkpoints == 0) // 等待初始化安排的后台检查点
+            {
+                this_thread::yield();
+            }
+            assert(jfs.checkpoint());
+            // 删除后 /a 的块空闲，但日志中还有它的记录，暂不分配；这两条记录不足以安排后台检查点
+            assert(jfs.deleteEntry("/a/f"));
+            assert(jfs.deleteEntry("/a"));
+            auto checkpoints = jfs.journalStats().checkpoints;
+            auto flushes = jfs.commitStats().flushes;
+
+            string big(95 * FileSystem::kBlockSize, 'z'); // 用完所有的块，最后一块只能在检查点之后分配
+            auto txn = jfs.beginTransaction();
+            txn->createFile("/big", FileSystem::File);
+            txn->writeFile("/big", big.data(), static_cast<int>(big.size()));
+            assert(txn->commit());
+            // 每个检查点刷新两次，提交事务刷新一次；提交之后可能还有后台检查点，先读检查点数
+            long n = jfs.journalStats().checkpoints - checkpoints;
+            assert(n >= 1 && jfs.commitStats().flushes - flushes >= 1 + 2 * n);
+            assert(*jfs.readFile("/big", FileSystem::kMaxFileSize) == big);
+            assert(jfs.closeFile("/big"));
+        }
+        remove("journal.disk");
+    }
+
+    // 每次写入只提交一条日志记录：先写数据块，再把目录项和修改过的各表一起提交
+    {
+        assert(fs.createFile("/d2/w", FileSystem::File));
+        assert(fs.closeFile("/d2/w"));
+        int fd = fs.open("/d2/w", FileSystem::Write);
+        auto records = fs.journalStats().records;
+        assert(fs.write(fd, dataout, 100)); // 分配新块，修改起始块号和大小
+        assert(fs.journalStats().records == records + 1);
+        assert(fs.write(fd, dataout + 100, 100)); // 追加
+        assert(fs.journalStats().records == records + 2);
+        assert(fs.close(fd));
+
+        assert(fs.clone("/d2/w", "/d2/wc"));
+        fd = fs.open("/d2/wc", FileSystem::Write);
+        records = fs.journalStats().records;
+        assert(fs.writeAt(fd, 0, "cow", 3)); // 复制共享的块
+        assert(fs.journalStats().records == records + 1);
+        assert(fs.close(fd));
+
+        assert(fs.createFile("/d2/wz", FileSystem::File | FileSystem::Compressed));
+        assert(fs.closeFile("/d2/wz"));
+        fd = fs.open("/d2/wz", FileSystem::Write);
+        records = fs.journalStats().records;
+        assert(fs.write(fd, dataout, 600)); // 跨越多个压缩单元
+        assert(fs.journalStats().records == records + 1);
+        assert(fs.close(fd));
+        assert(fs.readFile("/d2/wz", datain, 1024) == 600 && std::equal(datain, datain + 600, dataout));
+        assert(fs.closeFile("/d2/wz"));
+        assert(fs.readFile("/d2/wc", datain, 1024) == 200 && string(datain, datain + 3) == "cow");
+        assert(fs.closeFile("/d2/wc"));
+
+        FileSystem::FsckReport report;
+        assert(fs.fsck(report, false));
+        assert(fs.deleteEntry("/d2/w") && fs.deleteEntry("/d2/wc") && fs.deleteEntry("/d2/wz"));
+    }
+
+    // 一致性检查和修复
+    {
+        assert(Disk::CreateDisk("fsck.disk"));
+        Disk cd("fsck.disk");
+        FileSystem::FsckReport report;
+        {
+            FileSystem cfs(cd);
+            assert(cfs.initFileSystem());
+            assert(cfs.createDir("/a"));
+            assert(cfs.createFile("/a/f", FileSystem::File));
+            assert(cfs.writeFile("/a/f", dataout, 200));
+            assert(cfs.closeFile("/a/f"));
+            assert(cfs.createFile("/g", FileSystem::File));
+            assert(cfs.writeFile("/g", dataout + 200, 100));
+            assert(cfs.closeFile("/g"));
+            assert(cfs.createFile("/h", FileSystem::File));
+            assert(cfs.writeFile("/h", dataout, 100));
+            assert(cfs.closeFile("/h"));
+            assert(cfs.fsck(report, false));
+            assert(report.directories == 2 && report.files == 3 && report.repaired == false);
+            assert(cfs.checkpoint()); // 之后挂载时不会重放日志中的目录块
+        }
+        // 绕过文件系统修改根目录块：/g 与 /a/f 交叉链接，/h 指向 FAT 占用的块
+        // 日志在磁盘末尾，也有目录块的旧副本，取第一个找到的
+        char root[Disk::kSectorSize] = {};
+        char dir[Disk::kSectorSize] = {};
+        int rootSector = -1;
+        int dirSector = -1;
+        for (int sector = 0; sector != Disk::kNumOfSector; ++sector)
+        {
+            char block[Disk::kSectorSize];
+            assert(cd.read(block, sector));
+            if (rootSector < 0 && block[0] == 'a' && block[1] == '$' && block[8] == 'g' && block[16] == 'h')
+            {
+                rootSector = sector;
+                std::copy(block, block + Disk::kSectorSize, root);
+            }
+            if (dirSector < 0 && block[0] == 'f' && block[1] == '$')
+            {
+                dirSector = sector;
+                std::copy(block, block + Disk::kSectorSize, dir);
+            }
+        }
+        assert(rootSector >= 0 && dirSector >= 0);
+        root[8 + 5] = dir[5]; // 目录项的第 5 个字节是起始块号
+        root[16 + 5] = 0;
+        assert(cd.write(root, rootSector));
+        {
+            FileSystem cfs(cd);
+            cfs.setChecksumVerification(false); // 根目录块的校验和已经不符
+            assert(cfs.fsck(report, false) == false);
+            assert(report.badEntries == 1 && report.brokenChains == 0);
+            assert(report.refCountErrors == 1 && report.leakedBlocks == 4); // /g 和 /h 原来的块都泄漏了
+            assert(cfs.fsck(report, true) && report.repaired);
+            cfs.setChecksumVerification(true);
+            assert(cfs.fsck(report, false) && report.files == 3);
+            assert(cfs.stat("/h", st) && st.size == 0 && st.numOfBlocks == 0);
+            // 交叉链接修复为共享，写入时复制
+            assert(cfs.readFile("/g", datain, 1024) == 100 && std::equal(datain, datain + 100, dataout));
+            assert(cfs.closeFile("/g"));
+            int fd = cfs.open("/g", FileSystem::Write);
+            assert(cfs.writeAt(fd, 0, "shared", 6));
+            assert(cfs.close(fd));
+            assert(cfs.readFile("/a/f", datain, 1024) == 200 && std::equal(datain, datain + 200, dataout));
+            assert(cfs.closeFile("/a/f"));
+            assert(cfs.fsck(report, false));
+        }
+        remove("fsck.disk");
+    }
+
+    // fsck 期间工作线程上排队的修改操作在等待，fsck 不能再把读取交给工作线程
+    {
+        assert(Disk::CreateDisk("fsck.disk"));
+        Disk cd("fsck.disk");
+        {
+            FileSystem cfs(cd);
+            assert(cfs.initFileSystem());
+            assert(cfs.createDir("/a"));
+            assert(cfs.createDir("/b"));
+            for (int round = 0; round != 10; ++round)
+            {
+                vector<future<bool>> creates;
+                for (int i = 0; i != 8; ++i)
+                {
+                    creates.push_back(cfs.asyncCreate("/a/" + to_string(i), FileSystem::File));
+                }
+                FileSystem::FsckReport report;
+                assert(cfs.fsck(report, false));
+                for (int i = 0; i != 8; ++i)
+                {
+                    assert(creates[i].get());
+                    assert(cfs.closeFile("/a/" + to_string(i)));
+                    assert(cfs.deleteEntry("/a/" + to_string(i)));
+                }
+            }
+        }
+        remove("fsck.disk");
+    }
+
+    // 批量装入
+    {
+        assert(Disk::CreateDisk("bulk.disk"));
+        Disk bd("bulk.disk");
+        FileSystem bfs(bd);
+        vector<FileSystem::BulkEntry> entries = {
+            {"/a", true, ""},
+            {"/a/b/f", false, string(dataout, dataout + 300)}, // 父目录 /a/b 自动补上
+            {"/g", false, "xy"},
+            {"/e", false, ""},
+        };
+        assert(bfs.bulkLoad(entries));
+        assert(bfs.journalStats().records == 2); // 初始化和装入各一条记录
+        assert(bfs.getEntry("/a/b")->isDir());
+        assert(bfs.stat("/a/b/f", st) && st.size == 300 && st.numOfBlocks == 5);
+        assert(bfs.readFile("/a/b/f", datain, 1024) == 300 && std::equal(datain, datain + 300, dataout));
+        assert(bfs.closeFile("/a/b/f"));
+        assert(*bfs.readFile("/g", 10) == "xy");
+        assert(bfs.closeFile("/g"));
+        assert(bfs.stat("/e", st) && st.size == 0);
+        FileSystem::FsckReport report;
+        assert(bfs.fsck(report, false) && report.directories == 3 && report.files == 3);
+
+        assert(bfs.bulkLoad({{"/toolong", false, "x"}}) == false);       // 名称无效
+        assert(bfs.bulkLoad({{"/g", false, "x"}, {"/g/h", true, ""}}) == false); // 父目录是文件
+        assert(bfs.exist("/a/b/f"));                                    // 检查失败时不修改文件系统
+        assert(bfs.bulkLoad({{"/big", false, string(FileSystem::kMaxFileSize, 'x')}}) == false); // 空间不足
+        assert(bfs.fsck(report, false) && report.files == 0);
+        remove("bulk.disk");
+    }
+
+    // 调用记录
+    {
+        assert(Disk::CreateDisk("trace.disk"));
+        Disk td("trace.disk");
+        FileSystem tfs(td);
+        assert(tfs.initFileSystem());
+        assert(tfs.startTrace("trace.bin"));
+        assert(tfs.createFile("/f", FileSystem::File)); // 其中顺便打开文件，不单独记录
+        assert(tfs.writeFile("/f", dataout, 100));
+        assert(tfs.closeFile("/f"));
+        int fd = tfs.open("/f", FileSystem::Read);
+        assert(tfs.readAt(fd, 10, datain, 50) == 50);
+        assert(tfs.close(fd));
+        std::thread([&tfs]() { assert(tfs.exist("/f")); }).join();
+        tfs.stopTrace();
+        assert(tfs.deleteEntry("/f")); // 停止后不再记录
+
+        toyfs::TraceReader reader("trace.bin");
+        assert(reader.isValid());
+        vector<toyfs::TraceRecord> records;
+        toyfs::TraceRecord record;
+        while (reader.next(record))
+        {
+            records.push_back(record);
+        }
+        assert(records.size() == 7);
+        assert(records[0].op == toyfs::TraceOp::CreateFile && records[0].path == "/f");
+        assert(records[0].flags == FileSystem::File);
+        assert(records[1].op == toyfs::TraceOp::WriteFile && records[1].length == 100);
+        assert(records[2].op == toyfs::TraceOp::CloseFile);
+        assert(records[3].op == toyfs::TraceOp::Open && records[3].handle == fd);
+        assert(records[4].op == toyfs::TraceOp::ReadAt && records[4].handle == fd);
+        assert(records[4].offset == 10 && records[4].length == 50);
+        assert(records[5].op == toyfs::TraceOp::Close && records[5].handle == fd);
+        assert(records[6].op == toyfs::TraceOp::Exist && records[6].thread == 1);
+        for (int i = 0; i != 6; ++i)
+        {
+            assert(records[i].thread == 0);
+            assert(records[i].timestamp + records[i].duration <= records[i + 1].timestamp);
+        }
+        remove("trace.bin");
+        remove("trace.disk");
+    }
+
     delete[] datain;
     delete[] dataout;
 
@@ -0,0 +1,154 @@
+#include "trace.h"
+
+#include <algorithm>
+
+namespace toyfs
+{
+
+namespace
+{
+
+const char kMagic[] = {'T', 'F', 'T', 'R'};
+const char kVersion = 1;
+
+const char* kOpNames[] = {"createDir", "createFile",  "openFile",          "closeFile", "open",  "close",
+                          "read",      "write",       "readAt",            "writeAt",   "readv", "writev",
+                          "readFile",  "writeFile",   "setFileAttributes", "stat",      "clone", "deleteEntry",
+                          "getEntry",  "exist",       "sync",              "checkpoint"};
+static_assert(sizeof(kOpNames) / sizeof(kOpNames[0]) == static_cast<int>(TraceOp::NumOfOps), "Mismatch constants.");
+
+void putVarint(std::string& buf, std::uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        buf += static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    buf += static_cast<char>(value);
+}
+
+// zigzag 编码，绝对值小的负数也只占一个字节
+void putSigned(std::string& buf, std::int64_t value)
+{
+    putVarint(buf, (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63));
+}
+
+void putString(std::string& buf, const std::string& s)
+{
+    putVarint(buf, s.size());
+    buf += s;
+}
+
+} // namespace
+
+const char* traceOpName(TraceOp op)
+{
+    return op < TraceOp::NumOfOps ? kOpNames[static_cast<int>(op)] : "unknown";
+}
+
+TraceWriter::TraceWriter(const std::string& path) :
+    m_start(std::chrono::steady_clock::now()), m_os(path, std::ios::binary | std::ios::trunc), m_lastTimestamp(0)
+{
+    m_os.write(kMagic, sizeof(kMagic));
+    m_os.put(kVersion);
+}
+
+bool TraceWriter::isValid()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_os.good();
+}
+
+std::int64_t TraceWriter::elapsed() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+void TraceWriter::append(TraceRecord record)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // 记录在调用结束时追加，时间戳不一定递增，差值可能为负
+    auto thread = m_threads.insert({std::this_thread::get_id(), static_cast<int>(m_threads.size())}).first->second;
+    m_buffer.clear();
+    m_buffer += static_cast<char>(record.op);
+    putVarint(m_buffer, thread);
+    putSigned(m_buffer, record.timestamp - m_lastTimestamp);
+    putVarint(m_buffer, record.duration);
+    putSigned(m_buffer, record.handle);
+    putSigned(m_buffer, record.offset);
+    putSigned(m_buffer, record.length);
+    putSigned(m_buffer, record.flags);
+    putString(m_buffer, record.path);
+    putString(m_buffer, record.path2);
+    m_os.write(m_buffer.data(), m_buffer.size());
+    m_lastTimestamp = record.timestamp;
+}
+
+TraceReader::TraceReader(const std::string& path) : m_is(path, std::ios::binary), m_valid(false), m_lastTimestamp(0)
+{
+    char header[sizeof(kMagic) + 1];
+    m_valid = m_is.read(header, sizeof(header)) && std::equal(kMagic, kMagic + sizeof(kMagic), header) &&
+              header[sizeof(kMagic)] == kVersion;
+}
+
+bool TraceReader::isValid()
+{
+    return m_valid;
+}
+
+bool TraceReader::next(TraceRecord& record)
+{
+    if (!m_valid) return false;
+    int op = m_is.get();
+    if (op == std::char_traits<char>::eof() || op >= static_cast<int>(TraceOp::NumOfOps)) return false;
+    record.op = static_cast<TraceOp>(op);
+
+    std::uint64_t thread, duration;
+    std::int64_t delta, handle, offset, length, flags;
+    if (!readVarint(thread) || !readSigned(delta) || !readVarint(duration) || !readSigned(handle) ||
+        !readSigned(offset) || !readSigned(length) || !readSigned(flags) || !readString(record.path) ||
+        !readString(record.path2))
+    {
+        return false; // 记录不完整，例如记录时进程崩溃
+    }
+    m_lastTimestamp += delta;
+    record.thread = static_cast<int>(thread);
+    record.timestamp = m_lastTimestamp;
+    record.duration = static_cast<std::int64_t>(duration);
+    record.handle = static_cast<int>(handle);
+    record.offset = static_cast<int>(offset);
+    record.length = static_cast<int>(length);
+    record.flags = static_cast<int>(flags);
+    return true;
+}
+
+bool TraceReader::readVarint(std::uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int c = m_is.get();
+        if (c == std::char_traits<char>::eof()) return false;
+        value |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false; // 超过 10 个字节，不是有效的编码
+}
+
+bool TraceReader::readSigned(std::int64_t& value)
+{
+    std::uint64_t v;
+    if (!readVarint(v)) return false;
+    value = static_cast<std::int64_t>(v >> 1) ^ -static_cast<std::int64_t>(v & 1);
+    return true;
+}
+
+bool TraceReader::readString(std::string& s)
+{
+    std::uint64_t size;
+    if (!readVarint(size) || size > (1 << 16)) return false; // 路径不会这么长
+    s.resize(size);
+    return size == 0 || m_is.read(&s[0], size);
+}
+
+} // namespace toyfs
@@ -0,0 +1,128 @@
+//===-- trace.h - Binary trace of FileSystem calls ------------------------===//
+//
+// The Toy FAT FileSystem
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Records FileSystem API calls to a compact binary file and reads them back,
+/// so that a workload can be replayed later against a fresh image.
+///
+/// The file starts with a 4-byte magic and a version byte. Each record is the
+/// operation byte followed by LEB128 varints: thread, timestamp delta from the
+/// previous record, duration, handle, offset, length and flags (signed fields
+/// zigzag encoded), then the length-prefixed path and second path. Only sizes
+/// are recorded, never file contents.
+///
+//===----------------------------------------------------------------------===//
+#ifndef TOYFS_TRACE_H_
+#define TOYFS_TRACE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace toyfs
+{
+
+// 记录的调用，数值写入文件，只能在末尾追加
+enum class TraceOp : std::uint8_t
+{
+    CreateDir,
+    CreateFile,
+    OpenFile,
+    CloseFile,
+    Open,
+    Close,
+    Read,
+    Write,
+    ReadAt,
+    WriteAt,
+    Readv,
+    Writev,
+    ReadFile,
+    WriteFile,
+    SetFileAttributes,
+    Stat,
+    Clone,
+    DeleteEntry,
+    GetEntry,
+    Exist,
+    Sync,
+    Checkpoint,
+    NumOfOps
+};
+
+const char* traceOpName(TraceOp op);
+
+// 一次调用
+struct TraceRecord
+{
+    TraceOp op;
+    int thread;             // 线程序号，按第一次出现的顺序从 0 编号
+    std::int64_t timestamp; // 调用开始的时间，从开始记录起的微秒数
+    std::int64_t duration;  // 调用耗时（微秒）
+    int handle;             // 文件描述符，open 为返回值，没有时为 -1
+    int offset;             // readAt/writeAt 的偏移
+    int length;             // 读写的字节数，readv/writev 为各数据段的总长度
+    int flags;              // 打开方式、属性或者 readv/writev 的数据段数
+    std::string path;
+    std::string path2; // clone 的目标路径
+};
+
+class TraceWriter
+{
+public:
+    explicit TraceWriter(const std::string& path);
+    // keep from copying
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    bool isValid();
+    /**
+     * @brief elapsed 从开始记录起的微秒数，用于填写 TraceRecord::timestamp。
+     */
+    std::int64_t elapsed() const;
+    /**
+     * @brief append 追加一条记录，线程号由当前线程决定。线程安全。
+     */
+    void append(TraceRecord record);
+
+private:
+    std::chrono::steady_clock::time_point m_start;
+    std::ofstream m_os;
+    std::int64_t m_lastTimestamp;
+    std::unordered_map<std::thread::id, int> m_threads;
+    std::string m_buffer; // 编码一条记录用
+    std::mutex m_mutex;
+};
+
+class TraceReader
+{
+public:
+    explicit TraceReader(const std::string& path);
+
+    bool isValid();
+    /**
+     * @brief next 读取下一条记录。
+     * @return 读到完整的记录时为 true，文件结束或者记录不完整时为 false。
+     */
+    bool next(TraceRecord& record);
+
+private:
+    bool readVarint(std::uint64_t& value);
+    bool readSigned(std::int64_t& value);
+    bool readString(std::string& s);
+
+    std::ifstream m_is;
+    bool m_valid;
+    std::int64_t m_lastTimestamp;
+};
+
+} // namespace toyfs
+
+#endif // TOYFS_TRACE_H_